@@ -0,0 +1,17 @@
+#!/bin/sh
+# Play a file of each format headlessly with the allocation counting
+# build, which fails if anything but key handling allocates once
+# playback reached its steady state.
+# Usage: alloc_stats.sh YATM MKINPUT DIRECTORY FORMAT
+yatm=$1 mkinput=$2 dir=$3 format=$4
+file=$dir/alloc_stats.$format
+"$mkinput" $format "$file" 6 || exit 1
+output=$("$yatm" --replay-keys /dev/null "$file")
+status=$?
+echo "$output"
+rm -f "$file"
+if echo "$output" | grep -q "no steady state"; then
+  echo "$format: did not play long enough"
+  exit 1
+fi
+exit $status
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Play through artificially slow input (--io-delay) and check that the
+# stalls are noticed and counted, and that no audio is lost.
+# Usage: io_delay.sh YATM MKINPUT DIRECTORY
+yatm=$1 mkinput=$2 dir=$3
+status=0
+for format in wav flac; do
+  file=$dir/io_delay.$format
+  "$mkinput" $format "$file" 10 || exit 1
+  output=$("$yatm" --io-delay 20 --readahead 128 --replay-keys /dev/null "$file") || exit 1
+  echo "$output"
+  echo "$output" | awk -v format=$format '
+    /^input:/ { stalls = $2 }
+    / s in, / { for (i = 1; i < NF; i++) {
+		  if ($(i+1) == "s" && $(i+2) == "in,") seconds_in = $i
+		  if ($(i+1) == "s" && $(i+2) == "out,") seconds_out = $i } }
+    END {
+      if (stalls < 1) { print format ": no stalls counted"; exit 1 }
+      if (seconds_in < 9.9) { print format ": only " seconds_in " s read"; exit 1 }
+      if (seconds_out < 9.9) { print format ": only " seconds_out " s played"; exit 1 }
+    }' || status=1
+  rm -f "$file"
+done
+exit $status
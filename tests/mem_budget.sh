@@ -0,0 +1,12 @@
+#!/bin/sh
+# Play two hours of silent audio headlessly under a small memory budget;
+# yatm fails if its peak RSS exceeded it.  FORMAT is wav or flac, the
+# latter goes through the decoder, the read-ahead window and the history.
+# Usage: mem_budget.sh YATM MKINPUT DIRECTORY FORMAT
+yatm=$1 mkinput=$2 dir=$3 format=$4
+file=$dir/mem_budget.$format
+"$mkinput" silent-$format "$file" 7200 || exit 1
+"$yatm" --mem-budget 16 --replay-keys /dev/null "$file"
+status=$?
+rm -f "$file"
+exit $status
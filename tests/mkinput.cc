@@ -0,0 +1,248 @@
+/*
+ * mkinput - write test input for yatm
+ * Copyright (C) 2004, 2005, 2006, 2013 Mario Lang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Usage: mkinput FORMAT FILE SECONDS
+ * Writes SECONDS of a stereo 44.1 kHz tone sweep to FILE.  Speex is
+ * wideband mono, MP3 is silent mono, since there is no encoder to use.
+ * silent-wav is a sparse file and silent-flac compresses to almost
+ * nothing, so hours of either take little disk space.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ogg/ogg.h>
+#include <sndfile.h>
+#include <speex/speex.h>
+#include <speex/speex_header.h>
+
+#define RATE 44100
+#define CHANNELS 2
+#define BLOCK 4096
+
+/* A slow sweep, so that every block differs */
+static void
+tone (short *samples, long long pos, int frames, int channels, int rate)
+{
+  for (int i = 0; i < frames; i++) {
+    double t = (pos + i) / (double)rate;
+    double f = 220 + 110 * sin(2 * M_PI * t / 7);
+    short sample = (short)(8000 * sin(2 * M_PI * f * t));
+    for (int c = 0; c < channels; c++)
+      samples[i * channels + c] = c ? sample / 2 : sample;
+  }
+}
+
+static int
+write_sndfile (char const *filename, int format, double seconds, int silent)
+{
+  SF_INFO info;
+  SNDFILE *file;
+  short samples[BLOCK * CHANNELS];
+  long long frames = (long long)(seconds * RATE);
+  memset(&info, 0, sizeof(info));
+  info.samplerate = RATE;
+  info.channels = CHANNELS;
+  info.format = format;
+  if (!(file = sf_open(filename, SFM_WRITE, &info))) {
+    fprintf(stderr, "Can not write %s: %s\n", filename, sf_strerror(NULL));
+    return 0;
+  }
+  for (long long pos = 0; pos < frames; pos += BLOCK) {
+    int n = frames - pos < BLOCK ? (int)(frames - pos) : BLOCK;
+    if (silent)
+      memset(samples, 0, sizeof(samples));
+    else
+      tone(samples, pos, n, CHANNELS, RATE);
+    sf_writef_short(file, samples, n);
+  }
+  sf_close(file);
+  return 1;
+}
+
+static int
+write_ogg_page (FILE *file, ogg_page *page)
+{
+  return fwrite(page->header, 1, page->header_len, file) == (size_t)page->header_len
+    && fwrite(page->body, 1, page->body_len, file) == (size_t)page->body_len;
+}
+
+/* Wideband Speex in Ogg, one frame per packet */
+static int
+write_speex (char const *filename, double seconds)
+{
+  SpeexMode const *mode = speex_lib_get_mode(SPEEX_MODEID_WB);
+  SpeexHeader header;
+  SpeexBits bits;
+  ogg_stream_state os;
+  ogg_packet op;
+  ogg_page og;
+  int rate = 16000, frameSize, quality = 8, bytes, ok = 1;
+  char comment[] = "\x07\0\0\0mkinput\0\0\0\0";
+  FILE *file = fopen(filename, "wb");
+  if (!file) {
+    fprintf(stderr, "Can not write %s: %s\n", filename, strerror(errno));
+    return 0;
+  }
+  void *enc = speex_encoder_init(mode);
+  speex_encoder_ctl(enc, SPEEX_GET_FRAME_SIZE, &frameSize);
+  speex_encoder_ctl(enc, SPEEX_SET_QUALITY, &quality);
+  speex_init_header(&header, rate, 1, mode);
+  header.frames_per_packet = 1;
+  ogg_stream_init(&os, 1);
+  op.packet = (unsigned char *)speex_header_to_packet(&header, &bytes);
+  op.bytes = bytes;
+  op.b_o_s = 1;
+  op.e_o_s = 0;
+  op.granulepos = 0;
+  op.packetno = 0;
+  ogg_stream_packetin(&os, &op);
+  free(op.packet);
+  op.packet = (unsigned char *)comment;
+  op.bytes = sizeof(comment) - 1;
+  op.b_o_s = 0;
+  op.packetno = 1;
+  ogg_stream_packetin(&os, &op);
+  while (ok && ogg_stream_flush(&os, &og))
+    ok = write_ogg_page(file, &og);
+
+  speex_bits_init(&bits);
+  long long frames = (long long)(seconds * rate);
+  short samples[frameSize];
+  char packet[2000];
+  for (long long pos = 0; ok && pos < frames; pos += frameSize) {
+    tone(samples, pos, frameSize, 1, rate);
+    speex_bits_reset(&bits);
+    speex_encode_int(enc, samples, &bits);
+    op.packet = (unsigned char *)packet;
+    op.bytes = speex_bits_write(&bits, packet, sizeof(packet));
+    op.e_o_s = pos + frameSize >= frames;
+    op.granulepos = pos + frameSize;
+    op.packetno++;
+    ogg_stream_packetin(&os, &op);
+    while (ok && ogg_stream_pageout(&os, &og))
+      ok = write_ogg_page(file, &og);
+  }
+  while (ok && ogg_stream_flush(&os, &og))
+    ok = write_ogg_page(file, &og);
+  speex_bits_destroy(&bits);
+  speex_encoder_destroy(enc);
+  ogg_stream_clear(&os);
+  if (fclose(file) || !ok) {
+    fprintf(stderr, "Can not write %s: %s\n", filename, strerror(errno));
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Silent MPEG-1 Layer III, 128 kbit/s mono at 44.1 kHz without padding.
+ * Zeroed side information codes no main data, which decodes to silence.
+ */
+#define MP3_FRAME_BYTES 417
+#define MP3_FRAME_SAMPLES 1152
+
+static int
+write_mp3 (char const *filename, double seconds)
+{
+  unsigned char frame[MP3_FRAME_BYTES] = { 0xff, 0xfb, 0x90, 0xc0 };
+  long long frames = (long long)(seconds * RATE / MP3_FRAME_SAMPLES);
+  FILE *file = fopen(filename, "wb");
+  int ok = file != NULL;
+  for (long long i = 0; ok && i < frames; i++)
+    ok = fwrite(frame, sizeof(frame), 1, file) == 1;
+  if (!file || fclose(file) || !ok) {
+    fprintf(stderr, "Can not write %s: %s\n", filename, strerror(errno));
+    return 0;
+  }
+  return 1;
+}
+
+static void
+put_le (unsigned char *p, unsigned long value, int bytes)
+{
+  for (int i = 0; i < bytes; i++) p[i] = (value >> (8 * i)) & 0xff;
+}
+
+/* A 16 bit WAV header followed by a hole */
+static int
+write_silent_wav (char const *filename, double seconds)
+{
+  unsigned long data = (unsigned long)(seconds * RATE) * CHANNELS * 2;
+  unsigned char header[44];
+  int ok;
+  if (data > 0xffffffffUL - 36) {
+    fprintf(stderr, "%g seconds do not fit into a WAV file\n", seconds);
+    return 0;
+  }
+  memcpy(header, "RIFF\0\0\0\0WAVEfmt ", 16);
+  put_le(header + 4, 36 + data, 4);
+  put_le(header + 16, 16, 4);
+  put_le(header + 20, 1, 2);			/* PCM */
+  put_le(header + 22, CHANNELS, 2);
+  put_le(header + 24, RATE, 4);
+  put_le(header + 28, RATE * CHANNELS * 2, 4);
+  put_le(header + 32, CHANNELS * 2, 2);
+  put_le(header + 34, 16, 2);
+  memcpy(header + 36, "data", 4);
+  put_le(header + 40, data, 4);
+  FILE *file = fopen(filename, "wb");
+  ok = file && fwrite(header, sizeof(header), 1, file) == 1 &&
+       fflush(file) == 0 &&
+       ftruncate(fileno(file), sizeof(header) + data) == 0;
+  if (!file || fclose(file) || !ok) {
+    fprintf(stderr, "Can not write %s: %s\n", filename, strerror(errno));
+    return 0;
+  }
+  return 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s wav|flac|spx|mp3|silent-wav|silent-flac FILE SECONDS\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  char const *format = argv[1], *filename = argv[2];
+  double seconds = atof(argv[3]);
+  int ok;
+  if (!strcmp(format, "wav"))
+    ok = write_sndfile(filename, SF_FORMAT_WAV | SF_FORMAT_PCM_16, seconds, 0);
+  else if (!strcmp(format, "flac"))
+    ok = write_sndfile(filename, SF_FORMAT_FLAC | SF_FORMAT_PCM_16, seconds, 0);
+  else if (!strcmp(format, "spx"))
+    ok = write_speex(filename, seconds);
+  else if (!strcmp(format, "mp3"))
+    ok = write_mp3(filename, seconds);
+  else if (!strcmp(format, "silent-wav"))
+    ok = write_silent_wav(filename, seconds);
+  else if (!strcmp(format, "silent-flac"))
+    ok = write_sndfile(filename, SF_FORMAT_FLAC | SF_FORMAT_PCM_16, seconds, 1);
+  else {
+    fprintf(stderr, "Unknown format %s\n", format);
+    ok = 0;
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
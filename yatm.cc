@@ -22,11 +22,15 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <slang.h>
@@ -36,134 +40,2229 @@
 #include <speex/speex_callbacks.h>
 #include <speex/speex_header.h>
 #include <speex/speex_stereo.h>
+#include <soundtouch/FIFOSampleBuffer.h>
 #include <soundtouch/SoundTouch.h>
+#include <sndfile.h>
 #include <ao/ao.h>
 
 #include <iostream>
 
 #include "config.h"
 
-static unsigned char verbosity = 1;
+static unsigned char verbosity = 1;
+
+static int
+initTTY ()
+{
+  SLtt_get_terminfo();
+  if (SLkp_init() != -1) {
+    if (SLang_init_tty(-1,0,1) != -1) {
+      return 1;
+    } else {
+      SLang_verror(SL_Open_Error, "Slang_init_tty failed.");
+    }
+  } else {
+    SLang_verror(SL_Open_Error, "SLkp_init failed.");
+  }
+  return 0;
+}
+
+static char quit = 0;
+static float tempo = 1.0;
+static int pitchCentDelta = 0;
+static int replaying = 0;	/* --replay-keys, a headless benchmark */
+
+/*
+ * --mem-budget, in bytes.  Every buffer that grows with the input or the
+ * settings gets a fixed share of it, the rest is left for code, libraries
+ * and stacks.  Peak RSS is checked against it at exit.
+ */
+static size_t memBudget = 0;
+#define HISTORY_SHARE 4		/* history gets 1/4 of the budget */
+#define READAHEAD_SHARE 16
+#define TEE_SHARE 16
+#define RESAMPLER_SHARE 16
+
+/*
+ * Diagnostics build (cmake -DYATM_ALLOC_STATS=ON): heap allocations and
+ * bytes copied are counted per pipeline stage, separately for startup and
+ * for steady state, which begins once ALLOC_WARMUP_SECONDS of audio have
+ * been played.  Allocations while handling a key are charged to "control";
+ * any other allocation in steady state is a regression in the hot path and
+ * makes yatm exit with a failure status.
+ */
+enum {
+  STAGE_INPUT, STAGE_DECODE, STAGE_HISTORY, STAGE_STRETCH, STAGE_OUTPUT,
+  STAGE_TEE, STAGE_CONTROL, STAGES
+};
+
+#ifdef ALLOC_STATS
+#define ALLOC_WARMUP_SECONDS 2
+
+static char const *stageNames[STAGES] = {
+  "input", "decode", "history", "stretch", "output", "tee", "control"
+};
+static struct {
+  unsigned long allocs[STAGES];
+  unsigned long long allocated[STAGES], copied[STAGES];
+} allocStats[2];		/* startup, steady state */
+static volatile int allocSteady = 0;
+static __thread int allocStage = STAGE_DECODE;
+
+static inline int
+set_stage (int stage)
+{
+  int previous = allocStage;
+  allocStage = stage;
+  return previous;
+}
+
+static inline void
+count_copy (int stage, unsigned long long bytes)
+{
+  __sync_fetch_and_add(&allocStats[allocSteady].copied[stage], bytes);
+}
+
+static inline void
+count_alloc (size_t bytes)
+{
+  __sync_fetch_and_add(&allocStats[allocSteady].allocs[allocStage], 1);
+  __sync_fetch_and_add(&allocStats[allocSteady].allocated[allocStage],
+		       (unsigned long long)bytes);
+}
+
+static inline void
+count_played (long long frames, unsigned int rate)
+{
+  if (!allocSteady && frames >= ALLOC_WARMUP_SECONDS * (long long)rate)
+    allocSteady = 1;
+}
+
+/*
+ * Interpose the allocator for the whole process, libraries included.
+ * The default operator new of libstdc++ calls malloc, its aligned variant
+ * aligned_alloc, so both are covered too.
+ */
+extern "C" {
+void *__libc_malloc (size_t);
+void *__libc_calloc (size_t, size_t);
+void *__libc_realloc (void *, size_t);
+void *__libc_memalign (size_t, size_t);
+void *__libc_valloc (size_t);
+void *__libc_pvalloc (size_t);
+
+void *
+malloc (size_t size)
+{
+  count_alloc(size);
+  return __libc_malloc(size);
+}
+
+void *
+calloc (size_t n, size_t size)
+{
+  count_alloc(n * size);
+  return __libc_calloc(n, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  count_alloc(size);
+  return __libc_realloc(ptr, size);
+}
+
+void *
+memalign (size_t alignment, size_t size)
+{
+  count_alloc(size);
+  return __libc_memalign(alignment, size);
+}
+
+int
+posix_memalign (void **ptr, size_t alignment, size_t size)
+{
+  count_alloc(size);
+  return (*ptr = __libc_memalign(alignment, size)) ? 0 : ENOMEM;
+}
+
+void *
+aligned_alloc (size_t alignment, size_t size)
+{
+  count_alloc(size);
+  return __libc_memalign(alignment, size);
+}
+
+void *
+valloc (size_t size)
+{
+  count_alloc(size);
+  return __libc_valloc(size);
+}
+
+void *
+pvalloc (size_t size)
+{
+  count_alloc(size);
+  return __libc_pvalloc(size);
+}
+}
+
+/*
+ * Returns the number of steady state allocations outside of key handling.
+ */
+static unsigned long
+alloc_report ()
+{
+  unsigned long hot = 0;
+  printf("%-8s %8s %10s %12s | %8s %10s %12s\n", "stage",
+	 "allocs", "bytes", "copied", "allocs", "bytes", "copied");
+  for (int i = 0; i < STAGES; i++) {
+    printf("%-8s %8lu %10llu %12llu | %8lu %10llu %12llu\n", stageNames[i],
+	   allocStats[0].allocs[i], allocStats[0].allocated[i],
+	   allocStats[0].copied[i], allocStats[1].allocs[i],
+	   allocStats[1].allocated[i], allocStats[1].copied[i]);
+    if (i != STAGE_CONTROL) hot += allocStats[1].allocs[i];
+  }
+  if (!allocSteady)
+    printf("Played less than %d seconds, no steady state\n",
+	   ALLOC_WARMUP_SECONDS);
+  return hot;
+}
+#else
+static inline int set_stage (int) { return 0; }
+static inline void count_copy (int, unsigned long long) { }
+static inline void count_played (long long, unsigned int) { }
+static inline unsigned long alloc_report () { return 0; }
+#endif
+
+using namespace soundtouch;
+
+/*
+ * Time-stretch engines.  SoundTouch (time domain overlap-add) is the
+ * default, --engine pvoc selects the phase vocoder below.
+ */
+class Stretcher {
+public:
+  virtual ~Stretcher() {}
+  virtual char const *name() const = 0;
+  virtual void setSampleRate(unsigned int rate) = 0;
+  virtual void setChannels(unsigned int channels) = 0;
+  virtual void setTempo(float tempo) = 0;
+  virtual void setPitch(float pitch) = 0;
+  virtual void putSamples(SAMPLETYPE const *samples, unsigned int frames) = 0;
+  virtual unsigned int receiveSamples(SAMPLETYPE *samples,
+				      unsigned int maxFrames) = 0;
+  /* Stretched frames ready to be received */
+  virtual unsigned int numSamples() const = 0;
+  /* Source frames put but not yet processed */
+  virtual unsigned int latency() const = 0;
+  virtual void flush() = 0;
+  virtual void clear() = 0;
+};
+
+class SoundTouchStretcher : public Stretcher {
+  class SoundTouch touch;
+public:
+  SoundTouchStretcher () {
+    touch.setSetting(SETTING_USE_QUICKSEEK, 0);
+    touch.setSetting(SETTING_USE_AA_FILTER, 1);
+  }
+  char const *name() const { return "soundtouch"; }
+  void setSampleRate(unsigned int rate) { touch.setSampleRate(rate); }
+  void setChannels(unsigned int channels) { touch.setChannels(channels); }
+  void setTempo(float tempo) { touch.setTempo(tempo); }
+  void setPitch(float pitch) { touch.setPitch(pitch); }
+  void putSamples(SAMPLETYPE const *samples, unsigned int frames)
+  { touch.putSamples(samples, frames); }
+  unsigned int receiveSamples(SAMPLETYPE *samples, unsigned int maxFrames)
+  { return touch.receiveSamples(samples, maxFrames); }
+  unsigned int numSamples() const { return touch.numSamples(); }
+  unsigned int latency() const { return touch.numUnprocessedSamples(); }
+  void flush() { touch.flush(); }
+  void clear() { touch.clear(); }
+};
+
+/*
+ * In-place radix-2 complex FFT on split real/imaginary arrays.
+ * Twiddles are stored per stage so that the butterfly loops run over
+ * contiguous memory and can be vectorized by the compiler.
+ */
+class FFT {
+  unsigned int n;
+  unsigned int *rev;
+  float *twRe, *twIm;		/* stage with half size h starts at h-1 */
+public:
+  FFT (unsigned int size) : n(size) {
+    unsigned int bits = 0;
+    while ((1U << bits) < n) bits++;
+    rev = new unsigned int[n];
+    for (unsigned int i = 0; i < n; i++) {
+      unsigned int r = 0;
+      for (unsigned int b = 0; b < bits; b++)
+	if (i & (1U << b)) r |= 1U << (bits - 1 - b);
+      rev[i] = r;
+    }
+    twRe = new float[n];
+    twIm = new float[n];
+    for (unsigned int h = 1; h < n; h *= 2)
+      for (unsigned int j = 0; j < h; j++) {
+	twRe[h - 1 + j] = cos(M_PI * j / h);
+	twIm[h - 1 + j] = sin(M_PI * j / h);
+      }
+  }
+  ~FFT () {
+    delete [] rev;
+    delete [] twRe;
+    delete [] twIm;
+  }
+  /* Unnormalized, the inverse transform scales by n */
+  void transform (float *re, float *im, int inverse) {
+    float const sign = inverse ? 1 : -1;
+    for (unsigned int i = 0; i < n; i++)
+      if (rev[i] > i) {
+	float t = re[i]; re[i] = re[rev[i]]; re[rev[i]] = t;
+	t = im[i]; im[i] = im[rev[i]]; im[rev[i]] = t;
+      }
+    for (unsigned int h = 1; h < n; h *= 2) {
+      float const *__restrict__ tr = twRe + h - 1, *__restrict__ ti = twIm + h - 1;
+      for (unsigned int g = 0; g < n; g += 2 * h) {
+	float *__restrict__ ar = re + g, *__restrict__ ai = im + g;
+	float *__restrict__ br = re + g + h, *__restrict__ bi = im + g + h;
+	for (unsigned int j = 0; j < h; j++) {
+	  float wr = tr[j], wi = sign * ti[j];
+	  float xr = br[j] * wr - bi[j] * wi;
+	  float xi = br[j] * wi + bi[j] * wr;
+	  br[j] = ar[j] - xr;
+	  bi[j] = ai[j] - xi;
+	  ar[j] += xr;
+	  ai[j] += xi;
+	}
+      }
+    }
+  }
+};
+
+static inline float
+wrap_phase (float phase)
+{
+  return phase - 2 * M_PI * floorf((phase + M_PI) / (2 * M_PI));
+}
+
+/*
+ * Phase vocoder.  Frames of SIZE samples are analysed every tempo/pitch
+ * synthesis hops and resynthesized every HOP samples, pitch is then
+ * shifted by resampling the result.  Channels are transformed in pairs,
+ * packed into the real and imaginary part of a single complex FFT.
+ */
+class PhaseVocoder : public Stretcher {
+  unsigned int rate, channels, size, hop, bins;
+  float tempo, pitch;
+  FFT *fft;
+  float *window, *omega;
+  float *re, *im, *specRe, *specIm;
+  float *lastPhase, *sumPhase;	/* bins per channel */
+  float *accum;			/* overlap-add, size per channel */
+  float *prev;			/* last vocoder output frame, for resampling */
+  double anaPos, resPos;
+  unsigned int lastHop;
+  int first;
+  FIFOSampleBuffer input, output;
+
+  void release () {
+    delete fft;
+    delete [] window; delete [] omega;
+    delete [] re; delete [] im; delete [] specRe; delete [] specIm;
+    delete [] lastPhase; delete [] sumPhase; delete [] accum; delete [] prev;
+    fft = NULL;
+  }
+
+  void setup () {
+    release();
+    if (!rate || !channels) return;
+    size = rate > 24000 ? 2048 : 1024;
+    hop = size / 4;
+    bins = size / 2 + 1;
+    fft = new FFT(size);
+    window = new float[size];
+    omega = new float[bins];
+    re = new float[size]; im = new float[size];
+    specRe = new float[2 * bins]; specIm = new float[2 * bins];
+    lastPhase = new float[channels * bins];
+    sumPhase = new float[channels * bins];
+    accum = new float[channels * size];
+    prev = new float[channels];
+    for (unsigned int i = 0; i < size; i++)
+      window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / size);
+    for (unsigned int k = 0; k < bins; k++)
+      omega[k] = 2 * M_PI * k / size;
+    input.setChannels(channels);
+    output.setChannels(channels);
+    clear();
+  }
+
+  /* Advance phases of one channel's spectrum in specRe/specIm[off...] */
+  void vocode (unsigned int off, unsigned int c) {
+    float *last = lastPhase + c * bins, *sum = sumPhase + c * bins;
+    for (unsigned int k = 0; k < bins; k++) {
+      float r = specRe[off + k], i = specIm[off + k];
+      float mag = sqrtf(r * r + i * i), phase = atan2f(i, r);
+      if (first) {
+	sum[k] = phase;
+      } else if (lastHop) {
+	float expected = omega[k] * lastHop;
+	float delta = wrap_phase(phase - last[k] - expected);
+	sum[k] = wrap_phase(sum[k] + (expected + delta) * hop / lastHop);
+      } else {
+	sum[k] = wrap_phase(sum[k] + omega[k] * hop);
+      }
+      last[k] = phase;
+      specRe[off + k] = mag * cosf(sum[k]);
+      specIm[off + k] = mag * sinf(sum[k]);
+    }
+  }
+
+  /* Resample HOP frames of vocoder output by PITCH into the output FIFO */
+  void resample (float const *frames) {
+    unsigned int max = (unsigned int)(hop / pitch) + 2, n = 0;
+    SAMPLETYPE *out = output.ptrEnd(max);
+    if (pitch == 1) {
+      for (unsigned int i = 0; i < hop * channels; i++)
+	out[i] = (SAMPLETYPE)frames[i];
+      output.putSamples(hop);
+      return;
+    }
+    /* position -1 is the last frame of the previous block */
+    while (resPos < hop - 1 && n < max) {
+      int i = (int)floor(resPos);
+      float frac = resPos - i;
+      for (unsigned int c = 0; c < channels; c++) {
+	float a = i < 0 ? prev[c] : frames[i * channels + c];
+	float b = frames[(i + 1) * channels + c];
+	out[n * channels + c] = (SAMPLETYPE)(a + frac * (b - a));
+      }
+      n++;
+      resPos += pitch;
+    }
+    resPos -= hop;
+    for (unsigned int c = 0; c < channels; c++)
+      prev[c] = frames[(hop - 1) * channels + c];
+    output.putSamples(n);
+  }
+
+  void process () {
+    float const scale = 1. / (1.5 * size);	/* Hann^2 at 75% overlap, IFFT */
+    float frames[hop * channels];
+    while (fft && input.numSamples() >= size) {
+      SAMPLETYPE const *in = input.ptrBegin();
+      for (unsigned int c = 0; c < channels; c += 2) {
+	int pair = c + 1 < channels;
+	for (unsigned int i = 0; i < size; i++) {
+	  re[i] = in[i * channels + c] * window[i];
+	  im[i] = pair ? in[i * channels + c + 1] * window[i] : 0;
+	}
+	fft->transform(re, im, 0);
+	/* Split the packed spectrum into the two real signals' spectra */
+	for (unsigned int k = 0; k < bins; k++) {
+	  unsigned int nk = (size - k) & (size - 1);
+	  specRe[k] = (re[k] + re[nk]) / 2;
+	  specIm[k] = (im[k] - im[nk]) / 2;
+	  specRe[bins + k] = (im[k] + im[nk]) / 2;
+	  specIm[bins + k] = (re[nk] - re[k]) / 2;
+	}
+	vocode(0, c);
+	if (pair) vocode(bins, c + 1);
+	else for (unsigned int k = 0; k < bins; k++)
+	  specRe[bins + k] = specIm[bins + k] = 0;
+	/* Repack both Hermitian spectra and transform back */
+	for (unsigned int k = 0; k < bins; k++) {
+	  re[k] = specRe[k] - specIm[bins + k];
+	  im[k] = specIm[k] + specRe[bins + k];
+	}
+	for (unsigned int k = bins; k < size; k++) {
+	  unsigned int nk = size - k;
+	  re[k] = specRe[nk] + specIm[bins + nk];
+	  im[k] = specRe[bins + nk] - specIm[nk];
+	}
+	fft->transform(re, im, 1);
+	float *__restrict__ a = accum + c * size;
+	float *__restrict__ b = accum + (c + 1) * size;
+	for (unsigned int i = 0; i < size; i++)
+	  a[i] += re[i] * window[i] * scale;
+	if (pair)
+	  for (unsigned int i = 0; i < size; i++)
+	    b[i] += im[i] * window[i] * scale;
+      }
+      for (unsigned int c = 0; c < channels; c++) {
+	float *a = accum + c * size;
+	for (unsigned int i = 0; i < hop; i++)
+	  frames[i * channels + c] = a[i];
+	memmove(a, a + hop, (size - hop) * sizeof(float));
+	memset(a + size - hop, 0, hop * sizeof(float));
+      }
+      resample(frames);
+      first = 0;
+      anaPos += hop * tempo / pitch;
+      lastHop = (unsigned int)anaPos;
+      anaPos -= lastHop;
+      input.receiveSamples(lastHop);
+    }
+  }
+
+public:
+  PhaseVocoder ()
+  : rate(0), channels(0), size(0), hop(0), bins(0), tempo(1), pitch(1),
+    fft(NULL), window(NULL), omega(NULL), re(NULL), im(NULL),
+    specRe(NULL), specIm(NULL), lastPhase(NULL), sumPhase(NULL),
+    accum(NULL), prev(NULL) {}
+  ~PhaseVocoder () { release(); }
+  char const *name() const { return "pvoc"; }
+  void setSampleRate (unsigned int newRate) {
+    if (newRate != rate) { rate = newRate; setup(); }
+  }
+  void setChannels (unsigned int newChannels) {
+    if (newChannels != channels) { channels = newChannels; setup(); }
+  }
+  void setTempo(float newTempo) { tempo = newTempo; }
+  void setPitch(float newPitch) { pitch = newPitch; }
+  void putSamples (SAMPLETYPE const *samples, unsigned int frames) {
+    input.putSamples(samples, frames);
+    process();
+  }
+  unsigned int receiveSamples (SAMPLETYPE *samples, unsigned int maxFrames)
+  { return output.receiveSamples(samples, maxFrames); }
+  unsigned int numSamples() const { return output.numSamples(); }
+  unsigned int latency() const { return input.numSamples(); }
+  void flush () {
+    if (!fft || input.isEmpty()) return;
+    SAMPLETYPE *end = input.ptrEnd(size);
+    memset(end, 0, size * channels * sizeof(SAMPLETYPE));
+    input.putSamples(size);
+    process();
+    input.clear();
+  }
+  void clear () {
+    input.clear();
+    output.clear();
+    if (!fft) return;
+    memset(accum, 0, channels * size * sizeof(float));
+    memset(prev, 0, channels * sizeof(float));
+    anaPos = resPos = 0;
+    lastHop = 0;
+    first = 1;
+  }
+};
+
+static Stretcher *st;
+static long long inFrames = 0;	/* source frames put into st */
+static double stretchCpu = 0;	/* CPU seconds spent inside st */
+
+/*
+ * CPU time of the calling thread, to time single stages.  That is a system
+ * call, so only replays, which report it, pay for it.
+ */
+static double
+thread_cpu ()
+{
+  struct timespec ts;
+  if (!replaying) return 0;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Format of the stream being played, as the decoder delivers it */
+static struct {
+  unsigned int rate, channels;
+} source;
+
+/*
+ * SoundTouch gets expensive and unintelligible well before MAX_SKIM_TEMPO.
+ * Above MAX_STRETCH_TEMPO we therefore skim: the stretcher keeps running at
+ * SKIM_STRETCH_TEMPO while the decoders drop whole frames/packets/blocks so
+ * that only SKIM_STRETCH_TEMPO/tempo of the source is decoded at all.
+ * Surviving chunks of SKIM_KEEP_SECONDS are joined with a short crossfade.
+ */
+#define MAX_STRETCH_TEMPO 5.0
+#define MAX_SKIM_TEMPO 20.0
+#define SKIM_STRETCH_TEMPO 2.5
+#define SKIM_KEEP_SECONDS 0.4
+#define SKIM_FADE_SECONDS 0.005
+#define SKIM_TAIL_SAMPLES 4096
+
+static struct {
+  unsigned long keep, drop;	/* pattern length in source frames */
+  unsigned long pos;		/* position within the current pattern */
+  unsigned int fade;		/* crossfade length in frames */
+  unsigned int tailFrames;	/* frames withheld for the next crossfade */
+  int dropped;			/* a block was dropped since the last put */
+} skim;
+static SAMPLETYPE skimTail[SKIM_TAIL_SAMPLES];
+
+static void
+skim_pattern ()
+{
+  if (source.rate && tempo > MAX_STRETCH_TEMPO) {
+    skim.keep = (unsigned long)(SKIM_KEEP_SECONDS * source.rate);
+    skim.drop = (unsigned long)(skim.keep * (tempo / SKIM_STRETCH_TEMPO - 1));
+    if (skim.pos >= skim.keep + skim.drop) skim.pos = 0;
+  } else {
+    skim.keep = skim.drop = skim.pos = 0;
+  }
+}
+
+static void
+skim_setup ()
+{
+  skim.fade = (unsigned int)(SKIM_FADE_SECONDS * source.rate);
+  if (skim.fade * source.channels > SKIM_TAIL_SAMPLES)
+    skim.fade = SKIM_TAIL_SAMPLES / source.channels;
+  skim.tailFrames = 0;
+  skim_pattern();
+}
+
+/*
+ * Optional pause handling in front of the stretcher (--silence).  The
+ * energy of every block is compared against a threshold with hysteresis.
+ * Once a pause has lasted SILENCE_MIN_PAUSE, the rest of it is either
+ * stretched at a higher tempo or cut down to a maximum length.
+ */
+#define SILENCE_MIN_PAUSE 0.3
+#define SILENCE_HYSTERESIS 5.0	/* dB */
+
+enum { SILENCE_OFF, SILENCE_SPEED, SILENCE_TRIM };
+
+static struct {
+  int mode;
+  float tempo;			/* SILENCE_SPEED: tempo within pauses */
+  float maxPause;		/* SILENCE_TRIM: longest pause kept, seconds */
+  float threshold;		/* dBFS */
+  float enter, leave;		/* mean square thresholds */
+  unsigned long quiet;		/* frames since the signal became quiet */
+  int silent;			/* quiet for at least SILENCE_MIN_PAUSE */
+  unsigned long long pauseFrames;
+  double saved;			/* seconds of listening time saved */
+} silence = { SILENCE_OFF, 3.0, 0.5, -45 };
+
+/* Stretcher tempo for the current user tempo, not counting pauses */
+static float
+base_tempo ()
+{
+  return tempo > MAX_STRETCH_TEMPO ? SKIM_STRETCH_TEMPO : tempo;
+}
+
+static float
+stretch_tempo ()
+{
+  float t = base_tempo();
+  if (silence.silent && silence.mode == SILENCE_SPEED && silence.tempo > t)
+    t = silence.tempo;
+  return t;
+}
+
+static void
+set_tempo (float newTempo)
+{
+  tempo = newTempo;
+  if (tempo > MAX_SKIM_TEMPO) tempo = MAX_SKIM_TEMPO;
+  st->setTempo(stretch_tempo());
+  skim_pattern();
+}
+
+static int
+parse_silence (char const *arg)
+{
+  char const *value = strchr(arg, ':');
+  size_t length = value ? (size_t)(value - arg) : strlen(arg);
+  if (length == 5 && !strncmp(arg, "speed", 5)) {
+    silence.mode = SILENCE_SPEED;
+    if (value) silence.tempo = atof(value + 1);
+    if (silence.tempo > MAX_STRETCH_TEMPO) silence.tempo = MAX_STRETCH_TEMPO;
+  } else if (length == 4 && !strncmp(arg, "trim", 4)) {
+    silence.mode = SILENCE_TRIM;
+    if (value) silence.maxPause = atof(value + 1);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static void
+silence_thresholds ()
+{
+  silence.enter = 32768. * 32768. * powf(10, silence.threshold / 10);
+  silence.leave = silence.enter * powf(10, SILENCE_HYSTERESIS / 10);
+}
+
+/*
+ * Mean square of N samples.  Eight partial sums keep the loop
+ * vectorizable without relaxing floating point semantics.
+ */
+static float
+block_energy (SAMPLETYPE const *__restrict__ samples, unsigned int n)
+{
+  float acc[8] = { 0, 0, 0, 0, 0, 0, 0, 0 }, sum = 0;
+  unsigned int i = 0;
+  for (; i + 8 <= n; i += 8)
+    for (unsigned int j = 0; j < 8; j++)
+      acc[j] += (float)samples[i + j] * (float)samples[i + j];
+  for (; i < n; i++)
+    sum += (float)samples[i] * (float)samples[i];
+  for (unsigned int j = 0; j < 8; j++)
+    sum += acc[j];
+  return n ? sum / n : 0;
+}
+
+/*
+ * Returns the number of leading FRAMES of SAMPLES to pass on.
+ */
+static unsigned int
+silence_stage (SAMPLETYPE const *samples, unsigned int frames)
+{
+  unsigned int rate = source.rate;
+  float energy = block_energy(samples, frames * source.channels);
+  int wasSilent = silence.silent;
+  if (energy > (silence.quiet ? silence.leave : silence.enter)) {
+    silence.quiet = 0;
+    silence.silent = 0;
+  } else {
+    silence.quiet += frames;
+    if (silence.quiet >= SILENCE_MIN_PAUSE * rate) silence.silent = 1;
+  }
+  if (silence.silent != wasSilent && silence.mode == SILENCE_SPEED)
+    st->setTempo(stretch_tempo());
+  if (!silence.silent) return frames;
+
+  silence.pauseFrames += frames;
+  if (silence.mode == SILENCE_SPEED) {
+    silence.saved += frames / (double)rate *
+		     (1 / base_tempo() - 1 / stretch_tempo());
+    return frames;
+  }
+  unsigned long maxPause = (unsigned long)(silence.maxPause * rate);
+  unsigned long before = silence.quiet - frames;
+  unsigned int keep = before >= maxPause ? 0 :
+		      maxPause - before < frames ? maxPause - before : frames;
+  silence.saved += (frames - keep) / (double)rate / base_tempo();
+  return keep;
+}
+
+static void
+silence_report ()
+{
+  if (silence.mode != SILENCE_OFF && source.rate)
+    printf("%.1f s of pauses, %.1f s of listening time saved\n",
+	   silence.pauseFrames / (double)source.rate, silence.saved);
+}
+
+/*
+ * Called by the decoders before decoding a block of FRAMES source frames.
+ * Returns non-zero if the block should be dropped without decoding it.
+ */
+static int
+skim_block (unsigned long frames)
+{
+  int drop;
+  if (!skim.drop) return 0;
+  drop = skim.pos >= skim.keep;
+  skim.pos = (skim.pos + frames) % (skim.keep + skim.drop);
+  if (drop) skim.dropped = 1;
+  return drop;
+}
+
+/*
+ * Non-zero if the decoder's pattern drops the block after the one just
+ * passed to skim_block(), so that its end is crossfaded into what follows.
+ */
+static int
+skim_cut ()
+{
+  return skim.drop && skim.pos >= skim.keep;
+}
+
+/*
+ * Number of source frames left in the current drop phase, for decoders
+ * which can skip by seeking instead of dropping block by block.
+ */
+static unsigned long
+skim_gap ()
+{
+  return skim.drop && skim.pos >= skim.keep ?
+    skim.keep + skim.drop - skim.pos : 0;
+}
+
+/*
+ * Hand decoded samples to the stretcher, through the silence stage.
+ * While skimming, the end of each kept chunk is held back and crossfaded
+ * into the start of the next one.  CUT is non-zero if a gap follows.
+ */
+static void
+put_samples (SAMPLETYPE const *samples, unsigned int frames, int cut)
+{
+  unsigned int channels = source.channels;
+  if (silence.mode != SILENCE_OFF &&
+      !(frames = silence_stage(samples, frames)))
+    return;
+  if (skim.tailFrames) {
+    if (skim.dropped) {
+      /* Crossfade in skimTail, samples may point into a read-only map */
+      unsigned int n = skim.tailFrames < frames ? skim.tailFrames : frames;
+      for (unsigned int i = 0; i < n; i++) {
+	float w = (i + 1) / (float)(n + 1);
+	for (unsigned int c = 0; c < channels; c++)
+	  skimTail[i*channels+c] = skimTail[i*channels+c] * (1 - w) +
+	                           samples[i*channels+c] * w;
+      }
+      double cpu = thread_cpu();
+      st->putSamples(skimTail, n);
+      stretchCpu += thread_cpu() - cpu;
+      inFrames += n;
+      samples += n * channels;
+      frames -= n;
+    } else {
+      double cpu = thread_cpu();
+      st->putSamples(skimTail, skim.tailFrames);
+      stretchCpu += thread_cpu() - cpu;
+      inFrames += skim.tailFrames;
+    }
+    skim.tailFrames = 0;
+  }
+  skim.dropped = 0;
+  if (cut && frames > 2 * skim.fade) {
+    frames -= skim.fade;
+    memcpy(skimTail, samples + frames * channels,
+	   skim.fade * channels * sizeof(SAMPLETYPE));
+    count_copy(STAGE_STRETCH, skim.fade * channels * sizeof(SAMPLETYPE));
+    skim.tailFrames = skim.fade;
+  }
+  double cpu = thread_cpu();
+  st->putSamples(samples, frames);
+  stretchCpu += thread_cpu() - cpu;
+  count_copy(STAGE_STRETCH, frames * channels * sizeof(SAMPLETYPE));
+  inFrames += frames;
+}
+
+/*
+ * Optional fixed device rate (--rate).  Stretched audio is converted by a
+ * windowed sinc polyphase filter with one phase per output position
+ * modulo the reduced rate ratio, so files of any rate play through a
+ * device opened once.  --resample-quality selects the filter length.
+ */
+#define RESAMPLE_BLOCK 4096
+
+static unsigned int const resampleTaps[] = { 8, 16, 32 };
+static float const resampleCutoff[] = { .80, .90, .95 };
+static char const *resampleQualities[] = { "low", "medium", "high" };
+
+static struct {
+  unsigned int outRate;		/* 0 for no conversion */
+  int quality;
+  unsigned int inRate, channels;
+  unsigned int up, down;	/* outRate / inRate in lowest terms */
+  unsigned int taps;
+  float *filter;		/* up phases of taps coefficients, NULL if up == down */
+  float *in;			/* one plane of taps + RESAMPLE_BLOCK per channel */
+  unsigned int fill;		/* frames in each plane */
+  unsigned long t;		/* next output, in 1/up input frames */
+  double cpu;
+  int overBudget;		/* refused, the filter did not fit */
+} resampler = { 0, 1 };
+
+static unsigned int
+device_rate (unsigned int rate)
+{
+  return resampler.outRate ? resampler.outRate : rate;
+}
+
+static unsigned int
+gcd (unsigned int a, unsigned int b)
+{
+  while (b) {
+    unsigned int r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
+}
+
+/* Taps per phase; decimating, the filter has to span more inputs */
+static unsigned int
+resample_taps (unsigned int up, unsigned int down)
+{
+  return resampleTaps[resampler.quality] * ((down + up - 1) / up);
+}
+
+static size_t
+resample_bytes (unsigned int up, unsigned int taps, unsigned int channels)
+{
+  return ((size_t)up * taps + channels * (taps + RESAMPLE_BLOCK)) *
+	 sizeof(float);
+}
+
+static void
+resample_setup (unsigned int rate, unsigned int channels)
+{
+  if (rate == resampler.inRate && channels == resampler.channels) return;
+  unsigned int g = gcd(resampler.outRate, rate);
+  unsigned int up = resampler.outRate / g, down = rate / g;
+  unsigned int taps = resample_taps(up, down);
+  resampler.inRate = rate;
+  resampler.channels = channels;
+  free(resampler.filter);
+  free(resampler.in);
+  resampler.filter = NULL;
+  resampler.in = NULL;
+  if (up == down) return;	/* already at the device rate */
+  /* Ratios in large terms need many phases, lower the quality to fit */
+  while (memBudget && resampler.quality > 0 &&
+	 resample_bytes(up, taps, channels) > memBudget / RESAMPLER_SHARE) {
+    resampler.quality--;
+    taps = resample_taps(up, down);
+    fprintf(stderr, "Resample quality lowered to %s to fit the budget\n",
+	    resampleQualities[resampler.quality]);
+  }
+  if (memBudget &&
+      resample_bytes(up, taps, channels) > memBudget / RESAMPLER_SHARE) {
+    fprintf(stderr, "Resampling %u to %u Hz needs %.1f MiB, over the budget\n",
+	    rate, resampler.outRate,
+	    resample_bytes(up, taps, channels) / 1048576.);
+    resampler.overBudget = 1;
+    quit = 1;
+    return;
+  }
+  resampler.up = up;
+  resampler.down = down;
+  resampler.taps = taps;
+  resampler.filter = (float *)malloc(up * taps * sizeof(float));
+  resampler.in = (float *)calloc(channels * (taps + RESAMPLE_BLOCK),
+				 sizeof(float));
+  if (!resampler.filter || !resampler.in) {
+    fprintf(stderr, "Can not allocate resampler for %u Hz\n", rate);
+    quit = 1;
+    return;
+  }
+
+  /* Prototype lowpass at the upsampled rate, split into its phases */
+  unsigned int length = up * taps;
+  double cutoff = resampleCutoff[resampler.quality] * .5 / (up > down ? up : down);
+  for (unsigned int n = 0; n < length; n++) {
+    double x = n - (length - 1) / 2.;
+    double sinc = x == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * x) / (M_PI * x);
+    double window = .42 - .5 * cos(2 * M_PI * (n + .5) / length) +
+		    .08 * cos(4 * M_PI * (n + .5) / length);
+    resampler.filter[(n % up) * taps + taps - 1 - n / up] = sinc * window;
+  }
+  /* Unity gain at DC for every phase, or the output ripples by phase */
+  for (unsigned int p = 0; p < up; p++) {
+    float *h = resampler.filter + p * taps;
+    double sum = 0;
+    for (unsigned int i = 0; i < taps; i++) sum += h[i];
+    for (unsigned int i = 0; i < taps; i++) h[i] /= sum;
+  }
+  resampler.fill = taps - 1;
+  resampler.t = (unsigned long)(taps - 1) * up;
+}
+
+/* Upper bound of output frames for FRAMES input frames */
+static unsigned int
+resample_frames (unsigned int frames)
+{
+  if (!resampler.outRate) return frames;
+  return (unsigned long long)frames * resampler.up / resampler.down +
+	 2 + frames / RESAMPLE_BLOCK;
+}
+
+/* Eight partial sums, for the same reason as in block_energy */
+static inline float
+dot_product (float const *__restrict__ x, float const *__restrict__ h,
+	     unsigned int n)
+{
+  float acc[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+  for (unsigned int i = 0; i < n; i += 8)
+    for (unsigned int j = 0; j < 8; j++)
+      acc[j] += x[i + j] * h[i + j];
+  return ((acc[0] + acc[4]) + (acc[1] + acc[5])) +
+	 ((acc[2] + acc[6]) + (acc[3] + acc[7]));
+}
+
+/*
+ * Convert FRAMES interleaved frames at SRC to the device rate.
+ * Returns the number of frames written to DST.
+ */
+static unsigned int
+resample (SAMPLETYPE const *src, unsigned int frames, SAMPLETYPE *dst)
+{
+  unsigned int channels = resampler.channels, taps = resampler.taps;
+  unsigned int up = resampler.up, down = resampler.down;
+  unsigned int size = taps + RESAMPLE_BLOCK, produced = 0;
+  if (!resampler.filter || !resampler.in) return 0;
+  double cpu = thread_cpu();
+  while (frames > 0) {
+    unsigned int n = size - resampler.fill < frames ? size - resampler.fill : frames;
+    for (unsigned int c = 0; c < channels; c++) {
+      float *plane = resampler.in + c * size + resampler.fill;
+      for (unsigned int i = 0; i < n; i++)
+	plane[i] = src[i * channels + c];
+    }
+    resampler.fill += n;
+    src += n * channels;
+    frames -= n;
+
+    while (resampler.t / up < resampler.fill) {
+      unsigned long i = resampler.t / up;
+      float const *h = resampler.filter + (resampler.t % up) * taps;
+      for (unsigned int c = 0; c < channels; c++) {
+	float y = dot_product(resampler.in + c * size + i - (taps - 1), h, taps);
+	if (y > 32767) y = 32767;
+	else if (y < -32768) y = -32768;
+	*dst++ = (SAMPLETYPE)y;
+      }
+      produced++;
+      resampler.t += down;
+    }
+
+    /* Keep the frames the next output still needs */
+    unsigned long next = resampler.t / up - (taps - 1);
+    unsigned int shift = next < resampler.fill ? next : resampler.fill;
+    for (unsigned int c = 0; c < channels; c++)
+      memmove(resampler.in + c * size, resampler.in + c * size + shift,
+	      (resampler.fill - shift) * sizeof(float));
+    resampler.fill -= shift;
+    resampler.t -= (unsigned long)shift * up;
+  }
+  resampler.cpu += thread_cpu() - cpu;
+  return produced;
+}
+
+/*
+ * Source position (in frames) of the next block handed to the stretcher.
+ * Recorded key events are tied to it, so that replaying them against the
+ * same file reproduces the same timeline.
+ */
+static long long streamPos = 0;
+
+static double
+now ()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * --responsive: output is taken from the stretcher in short slices, and
+ * none is taken while a key is pending.  When the key changes tempo or
+ * pitch, the output still held is thrown away and its source frames are
+ * stretched again with the new settings.  The last skim.fade frames are
+ * always held back from the device, so that they can be crossfaded into
+ * the output stretched again instead of being cut off.
+ */
+#define RESPONSIVE_BLOCK 256
+static int responsive = 0;
+static struct {
+  unsigned int frames;		/* output frames held back */
+  int fade;			/* crossfade them into the next output */
+} held;
+static SAMPLETYPE heldTail[SKIM_TAIL_SAMPLES];
+static unsigned long restretches = 0;
+
+/*
+ * Key event bookkeeping for --record-keys and --replay-keys.
+ * For every event we remember which output frame is the first one to
+ * reflect it, and when that frame was handed to libao.
+ */
+struct keyevent {
+  long long pos;		/* streamPos when the key was handled */
+  double time;			/* wall time relative to startTime */
+  int key;
+  long long outTarget;		/* first output frame reflecting the key */
+  long long outQueued;		/* output frames ahead of it */
+  double doneTime;		/* wall time outTarget was handed to libao */
+};
+
+static FILE *recordFile = NULL;
+static struct keyevent *events = NULL;
+static int nEvents = 0, maxEvents = 0;
+static int replayNext = 0, latencyNext = 0;
+static long long outFrames = 0;	/* stretched frames handed to libao */
+static double startTime;
+
+static struct keyevent *
+add_event (long long pos, double time, int key)
+{
+  if (nEvents == maxEvents) {
+    maxEvents = maxEvents ? maxEvents * 2 : 64;
+    events = (struct keyevent *)realloc(events, maxEvents * sizeof(*events));
+    if (!events) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  events[nEvents].pos = pos;
+  events[nEvents].time = time;
+  events[nEvents].key = key;
+  events[nEvents].outTarget = -1;
+  events[nEvents].doneTime = -1;
+  return &events[nEvents++];
+}
+
+static int
+load_events (char const *filename)
+{
+  FILE *f = fopen(filename, "r");
+  char line[128];
+  if (!f) {
+    fprintf(stderr, "Can not open %s: %s\n", filename, strerror(errno));
+    return 0;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    long long pos;
+    double time;
+    int key;
+    if (*line == '#') continue;
+    if (sscanf(line, "%lld %lf %d", &pos, &time, &key) != 3) {
+      fprintf(stderr, "%s: malformed line: %s", filename, line);
+      fclose(f);
+      return 0;
+    }
+    add_event(pos, time, key);
+  }
+  fclose(f);
+  return 1;
+}
+
+/* Is a key waiting to be handled by pollKeyboard? */
+static int
+key_pending ()
+{
+  if (replaying)
+    return !quit && replayNext < nEvents &&
+	   events[replayNext].pos <= streamPos;
+  return SLang_input_pending(0) > 0;
+}
+
+/*
+ * Called right after a key took effect.  Output already queued inside
+ * the stretcher, or held back, was produced with the old settings, unless
+ * it is about to be crossfaded.  After a seek, the source frames the
+ * stretcher holds are from before the seek too, while a new tempo or
+ * pitch applies to them.  The event's time was taken before the key was
+ * handled, so that seeking counts towards the latency.
+ */
+static void
+latency_mark (struct keyevent *event, int seek)
+{
+  event->outQueued = st->numSamples() + (held.fade ? 0 : held.frames);
+  if (seek)
+    event->outQueued += (long long)(st->latency() / stretch_tempo());
+  event->outTarget = outFrames + event->outQueued;
+}
+
+/*
+ * Called after each ao_play.
+ */
+static void
+latency_check ()
+{
+  while (latencyNext < nEvents && events[latencyNext].outTarget >= 0 &&
+	 events[latencyNext].outTarget < outFrames) {
+    events[latencyNext].doneTime = now() - startTime;
+    latencyNext++;
+  }
+}
+
+/*
+ * libao can not tell how much audio the driver and sound server still
+ * hold, so the audible latency is only estimated.  Played live, the wall
+ * time includes playing the queued output, but not the device buffer.
+ * Replayed headlessly, it does not, so the queued output is what the
+ * listener would wait for.
+ */
+static void
+latency_report (unsigned int rate)
+{
+  double sum = 0, max = 0, estimateSum = 0, estimateMax = 0;
+  int n = 0;
+  printf("%12s %5s %10s %10s %11s\n",
+	 "position", "key", "queued ms", "wall ms", "estimate ms");
+  for (int i = 0; i < nEvents; i++) {
+    struct keyevent *event = &events[i];
+    if (event->doneTime < 0) continue;
+    double wall = (event->doneTime - event->time) * 1000;
+    double queued = rate ? event->outQueued * 1000. / rate : 0.;
+    double estimate = queued > wall ? queued : wall;
+    printf("%12lld %5d %10.1f %10.3f %11.1f\n", event->pos, event->key,
+	   queued, wall, estimate);
+    sum += wall;
+    if (wall > max) max = wall;
+    estimateSum += estimate;
+    if (estimate > estimateMax) estimateMax = estimate;
+    n++;
+  }
+  if (n) {
+    printf("%d events, wall latency mean %.3f ms, max %.3f ms\n",
+	   n, sum / n, max);
+    printf("estimated audible latency mean %.1f ms, max %.1f ms%s\n",
+	   estimateSum / n, estimateMax,
+	   replaying ? "" : " plus the device buffer");
+  }
+}
+
+/*
+ * Throughput summary of a replay, to compare engines per workload.
+ */
+static void
+bench_report (unsigned int rate)
+{
+  struct rusage usage;
+  double cpu, wall = now() - startTime;
+  getrusage(RUSAGE_SELF, &usage);
+  cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  if (!rate) return;
+  printf("\nengine %s: %.3f s CPU, %.1f s in, %.1f s out, %.1fx realtime\n",
+	 st->name(), stretchCpu,
+	 inFrames / (double)rate, outFrames / (double)rate,
+	 stretchCpu > 0 ? inFrames / (double)rate / stretchCpu : 0.);
+  printf("process: %.3f s CPU, %.3f s wall\n", cpu, wall);
+  if (resampler.outRate)
+    printf("resampler %s, %u -> %u Hz: %.3f s CPU\n",
+	   resampleQualities[resampler.quality], rate, resampler.outRate,
+	   resampler.cpu);
+}
+
+typedef void (*SeekFunc)(float delta);
+
+static int seek_to (long long target);
+
+/*
+ * --responsive: throw away what the stretcher holds and what is held
+ * back, and stretch it again from the first source frame whose output
+ * has not been handed to libao yet.  This needs the history ring or a
+ * backend that can seek back; otherwise the change applies to new input
+ * only, as usual.  Skimming and --silence do not map output back to the
+ * source linearly, so they are left alone.
+ */
+static void
+restretch (float oldTempo)
+{
+  if (skim.drop || silence.mode != SILENCE_OFF) return;
+  long long target = streamPos - st->latency() -
+		     (long long)((st->numSamples() + held.frames) * oldTempo);
+  if (target < 0) target = 0;
+  if (seek_to(target)) {
+    st->clear();
+    held.fade = held.frames > 0;
+    restretches++;
+  }
+}
+
+/* Keys handle_key passes on to the seek function */
+static int
+seek_key (int key)
+{
+  return key == 'l' || key == SL_KEY_RIGHT || key == 'h' || key == SL_KEY_LEFT;
+}
+
+static void
+handle_key (int key, SeekFunc seekfunc)
+{
+  float oldTempo = stretch_tempo();
+  int oldPitch = pitchCentDelta;
+  unsigned long oldDrop = skim.drop;	/* the output held was skimmed */
+  switch (key) {
+  case 'l':
+  case SL_KEY_RIGHT:
+    if (seekfunc)
+      seekfunc(5);
+    else
+      if (verbosity) {
+	printf("Seeking not implemented for this backend\n");
+	fflush(stdout);
+      }
+    break;
+  case 'h':
+  case SL_KEY_LEFT:
+    if (seekfunc)
+      seekfunc(-5);
+    else
+      if (verbosity) {
+	printf("Seeking not implemented for this backend\n");
+	fflush(stdout);
+      }
+    break;
+  case '+':
+    if (tempo < MAX_SKIM_TEMPO)
+      set_tempo(tempo + (tempo < MAX_STRETCH_TEMPO ? .01 : .25));
+    break;
+  case '-':
+    if (tempo > 0.02)
+      set_tempo(tempo - (tempo > MAX_STRETCH_TEMPO ? .25 : .01));
+    break;
+  case 'c':
+    st->setPitch(powf(2.,(pitchCentDelta -= 1)/1200.));
+    break;
+  case 'C':
+    if (pitchCentDelta < 4800)
+      st->setPitch(powf(2.,(pitchCentDelta += 1)/1200.));
+    break;
+  case 's':
+  case SL_KEY_DOWN:
+    st->setPitch(powf(2.,(pitchCentDelta -= 100)/1200.));
+    break;
+  case 'S':
+  case SL_KEY_UP:
+    if (pitchCentDelta < 4701)
+      st->setPitch(powf(2.,(pitchCentDelta += 100)/1200.));
+    else
+      st->setPitch(powf(2.,(pitchCentDelta = 4800)/1200.));
+    break;
+  case 'q':
+  case SL_KEY_F(10):
+    quit = 1;
+    break;
+  }
+  if (responsive && !quit && !oldDrop &&
+      (stretch_tempo() != oldTempo || pitchCentDelta != oldPitch))
+    restretch(oldTempo);
+  if (!quit && verbosity > 0 && !replaying) {
+    printf("%3.0f%% speed %7d cents\r", tempo*100, pitchCentDelta);
+    fflush(stdout);
+  }
+}
+
+static void
+pollKeyboard (SeekFunc seekfunc)
+{
+  if (replaying) {
+    while (!quit && replayNext < nEvents &&
+	   events[replayNext].pos <= streamPos) {
+      int stage = set_stage(STAGE_CONTROL);
+      events[replayNext].time = now() - startTime;
+      handle_key(events[replayNext].key, seekfunc);
+      latency_mark(&events[replayNext], seek_key(events[replayNext].key));
+      replayNext++;
+      set_stage(stage);
+    }
+  } else if (SLang_input_pending(0) != 0) {
+    int key = SLkp_getkey();
+    int stage = set_stage(STAGE_CONTROL);
+    if (recordFile) {
+      /* Only recorded sessions keep events, and report their latency */
+      struct keyevent *event = add_event(streamPos, now() - startTime, key);
+      handle_key(key, seekfunc);
+      latency_mark(event, seek_key(key));
+      fprintf(recordFile, "%lld %.6f %d\n", event->pos, event->time, key);
+    } else {
+      handle_key(key, seekfunc);
+    }
+    set_stage(stage);
+  }
+}
+
+static struct sigaction save_sigint, save_sigtstp;
+static void signal_handler (int signal);
+
+static int audio_driver;
+static ao_device *audio_device;
+static ao_sample_format audio_format;
+
+/*
+ * --responsive also asks the driver for a short buffer, so that little
+ * audio is queued out of our reach.  Drivers without that option keep
+ * their default buffer, which libao does not tell.  The null driver plays
+ * nothing, so it is not asked.
+ */
+#define RESPONSIVE_BUFFER_MS 20
+
+static ao_device *
+open_device ()
+{
+  if (responsive && !replaying) {
+    ao_option *options = NULL;
+    char value[16];
+    snprintf(value, sizeof(value), "%d", RESPONSIVE_BUFFER_MS);
+    ao_append_option(&options, "buffer_time", value);
+    ao_device *device = ao_open_live(audio_driver, &audio_format, options);
+    ao_free_options(options);
+    if (device) return device;
+  }
+  return ao_open_live(audio_driver, &audio_format, NULL);
+}
+
+/*
+ * --tee: everything handed to libao is also written to a sound file.
+ * Writing happens on a separate thread behind a bounded queue, if the disk
+ * can not keep up we rather lose blocks in the file than stall playback.
+ */
+#define TEE_QUEUE_BLOCKS 64
+#define TEE_BLOCK_SAMPLES 8192
+
+static struct {
+  char const *filename;
+  SNDFILE *file;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;		/* a block was queued */
+  pthread_cond_t space;		/* a block was written */
+  int wait;			/* wait for space instead of dropping */
+  struct {
+    short samples[TEE_BLOCK_SAMPLES];
+    sf_count_t frames;
+  } queue[TEE_QUEUE_BLOCKS];
+  unsigned int blocks;		/* slots in use, a power of two */
+  unsigned int head, tail;	/* producer and consumer index */
+  int done;
+  unsigned long dropped;	/* blocks lost because the queue was full */
+} teeSink;
+
+static int
+tee_format (char const *filename)
+{
+  char const *ext = strrchr(filename, '.');
+  if (ext) {
+    if (!strcasecmp(ext, ".flac")) return SF_FORMAT_FLAC | SF_FORMAT_PCM_16;
+    if (!strcasecmp(ext, ".ogg")) return SF_FORMAT_OGG | SF_FORMAT_VORBIS;
+    if (!strcasecmp(ext, ".aiff") || !strcasecmp(ext, ".aif"))
+      return SF_FORMAT_AIFF | SF_FORMAT_PCM_16;
+  }
+  return SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+}
+
+static void *
+tee_writer (void *data)
+{
+  set_stage(STAGE_TEE);
+  pthread_mutex_lock(&teeSink.lock);
+  for (;;) {
+    while (teeSink.tail == teeSink.head && !teeSink.done)
+      pthread_cond_wait(&teeSink.cond, &teeSink.lock);
+    if (teeSink.tail == teeSink.head) break;
+    unsigned int slot = teeSink.tail % teeSink.blocks;
+    pthread_mutex_unlock(&teeSink.lock);
+    sf_writef_short(teeSink.file, teeSink.queue[slot].samples, teeSink.queue[slot].frames);
+    pthread_mutex_lock(&teeSink.lock);
+    teeSink.tail++;
+    pthread_cond_signal(&teeSink.space);
+  }
+  pthread_mutex_unlock(&teeSink.lock);
+  return NULL;
+}
+
+static int
+tee_open (int channels, int rate)
+{
+  SF_INFO info;
+  memset(&info, 0, sizeof(info));
+  info.channels = channels;
+  info.samplerate = rate;
+  info.format = tee_format(teeSink.filename);
+  if (!(teeSink.file = sf_open(teeSink.filename, SFM_WRITE, &info))) {
+    fprintf(stderr, "Can not write %s: %s\n", teeSink.filename, sf_strerror(NULL));
+    teeSink.filename = NULL;
+    return 0;
+  }
+  teeSink.blocks = TEE_QUEUE_BLOCKS;
+  while (memBudget && teeSink.blocks > 2 &&
+	 teeSink.blocks * sizeof(teeSink.queue[0]) > memBudget / TEE_SHARE)
+    teeSink.blocks /= 2;
+  pthread_mutex_init(&teeSink.lock, NULL);
+  pthread_cond_init(&teeSink.cond, NULL);
+  pthread_cond_init(&teeSink.space, NULL);
+  if (pthread_create(&teeSink.thread, NULL, tee_writer, NULL) != 0) {
+    fprintf(stderr, "Can not start tee writer thread.\n");
+    sf_close(teeSink.file);
+    teeSink.file = NULL;
+    teeSink.filename = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+static void
+tee_write (SAMPLETYPE const *samples, int frames, int channels)
+{
+  int stage = set_stage(STAGE_TEE);
+  if (!teeSink.file && (!teeSink.filename || !tee_open(channels, audio_format.rate))) {
+    set_stage(stage);
+    return;
+  }
+  while (frames > 0) {
+    int n = frames * channels > TEE_BLOCK_SAMPLES ?
+      TEE_BLOCK_SAMPLES / channels : frames;
+    pthread_mutex_lock(&teeSink.lock);
+    while (teeSink.wait && teeSink.head - teeSink.tail == teeSink.blocks)
+      pthread_cond_wait(&teeSink.space, &teeSink.lock);
+    int full = teeSink.head - teeSink.tail == teeSink.blocks;
+    pthread_mutex_unlock(&teeSink.lock);
+    if (full) {
+      teeSink.dropped++;
+    } else {
+      /* Only the producer touches the head slot until head is advanced */
+      unsigned int slot = teeSink.head % teeSink.blocks;
+      for (int i = 0; i < n * channels; i++)
+	teeSink.queue[slot].samples[i] = (short)samples[i];
+      count_copy(STAGE_TEE, n * channels * sizeof(short));
+      teeSink.queue[slot].frames = n;
+      pthread_mutex_lock(&teeSink.lock);
+      teeSink.head++;
+      pthread_cond_signal(&teeSink.cond);
+      pthread_mutex_unlock(&teeSink.lock);
+    }
+    samples += n * channels;
+    frames -= n;
+  }
+  set_stage(stage);
+}
+
+static void
+tee_close ()
+{
+  if (!teeSink.file) return;
+  pthread_mutex_lock(&teeSink.lock);
+  teeSink.done = 1;
+  pthread_cond_signal(&teeSink.cond);
+  pthread_mutex_unlock(&teeSink.lock);
+  pthread_join(teeSink.thread, NULL);
+  sf_close(teeSink.file);
+  teeSink.file = NULL;
+  if (teeSink.dropped)
+    fprintf(stderr, "%s: %lu blocks lost, disk too slow\n",
+	    teeSink.filename, teeSink.dropped);
+}
+
+/*
+ * --responsive: OUTPUT holds the held back frames followed by FRAMES new
+ * ones.  After a re-stretch, the held frames are crossfaded into the new
+ * ones, which start at the same source frame.  Unless DRAIN, the last
+ * skim.fade frames are held back again.  Returns the frames to play,
+ * which start at *START.
+ */
+static unsigned int
+hold_output (SAMPLETYPE *output, unsigned int frames, unsigned int channels,
+	     int drain, SAMPLETYPE **start)
+{
+  unsigned int n = held.frames;
+  memcpy(output, heldTail, n * channels * sizeof(SAMPLETYPE));
+  count_copy(STAGE_OUTPUT, n * channels * sizeof(SAMPLETYPE));
+  *start = output;
+  if (held.fade && frames > 0) {
+    SAMPLETYPE *fresh = output + n * channels;
+    unsigned int m = n < frames ? n : frames;
+    for (unsigned int i = 0; i < m; i++) {
+      float w = (i + 1) / (float)(m + 1);
+      for (unsigned int c = 0; c < channels; c++)
+	fresh[i * channels + c] = output[i * channels + c] * (1 - w) +
+				  fresh[i * channels + c] * w;
+    }
+    held.fade = 0;
+    *start = fresh;
+    n = 0;
+  } else if (held.fade) {
+    if (!drain) return 0;	/* keep them until the new output comes */
+    held.fade = 0;
+  }
+  frames += n;
+  held.frames = 0;
+  if (!drain) {
+    held.frames = frames < skim.fade ? frames : skim.fade;
+    frames -= held.frames;
+    memcpy(heldTail, *start + frames * channels,
+	   held.frames * channels * sizeof(SAMPLETYPE));
+    count_copy(STAGE_OUTPUT, held.frames * channels * sizeof(SAMPLETYPE));
+  }
+  return frames;
+}
+
+/*
+ * Play everything the stretcher holds, PLAY_BLOCK frames at a time, so the
+ * buffers on the way to the device do not grow with the input blocks.
+ * With --responsive the slices are shorter, and playing stops as soon as
+ * a key is pending, unless DRAIN.
+ */
+#define PLAY_BLOCK 1024
+
+static void
+play_ao (int channels, int drain)
+{
+  int bufsize = responsive ? RESPONSIVE_BLOCK : PLAY_BLOCK;
+  int heldMax = responsive ? SKIM_TAIL_SAMPLES / channels : 0;
+  int maxFrames = resample_frames(heldMax + bufsize);
+  SAMPLETYPE samples[(heldMax + bufsize) * channels];
+  SAMPLETYPE resampled[resampler.outRate ? maxFrames * channels : 1];
+  SAMPLETYPE *ptr;
+  char buffer[maxFrames * channels * sizeof(signed int)];
+  char *byte;
+  int outSamples;
+  if (resampler.outRate) {
+    resample_setup(source.rate, channels);
+    /* Refused or failed, play nothing rather than at the wrong rate */
+    if (resampler.outRate != source.rate &&
+	!(resampler.filter && resampler.in))
+      return;
+  }
+  do {
+    if (responsive && !drain && key_pending()) break;
+    ptr = samples + held.frames * channels;
+    byte = buffer;
+    double cpu = thread_cpu();
+    outSamples = st->receiveSamples(ptr, bufsize);
+    stretchCpu += thread_cpu() - cpu;
+    count_copy(STAGE_STRETCH, outSamples * channels * sizeof(SAMPLETYPE));
+    int frames = outSamples;
+    if (responsive)
+      frames = hold_output(samples, outSamples, channels, drain, &ptr);
+    int deviceFrames = frames;
+    if (resampler.filter && frames > 0) {
+      deviceFrames = resample(ptr, frames, resampled);
+      count_copy(STAGE_OUTPUT, deviceFrames * channels * sizeof(SAMPLETYPE));
+      ptr = resampled;
+    }
+    if (teeSink.filename && deviceFrames > 0)
+      tee_write(ptr, deviceFrames, channels);
+    for (int i = 0; i < deviceFrames; i++) {
+      signed int sample;
+      for (int c = 0; c < channels; c++) {
+	sample = (int)*ptr++;
+	*byte++ = (sample >> 0) & 0xff;
+	*byte++ = (sample >> 8) & 0xff;
+      }
+    }
+    if (byte-buffer > 0) {
+      count_copy(STAGE_OUTPUT, 2 * (byte-buffer));
+      ao_play(audio_device, buffer, byte-buffer);
+    }
+    outFrames += frames;
+    count_played(outFrames, source.rate);
+    latency_check();
+  } while (outSamples != 0);
+}
+
+/*
+ * Stretch FRAMES frames starting at streamPos and play the result.
+ * CUT is non-zero if a skimmed gap follows the last frame.
+ */
+static void
+stretch_and_play (SAMPLETYPE const *samples, unsigned int frames,
+		  unsigned int channels, int cut)
+{
+  int stage = set_stage(STAGE_STRETCH);
+  put_samples(samples, frames, cut);
+  streamPos += frames;
+  set_stage(STAGE_OUTPUT);
+  play_ao(channels, 0);
+  set_stage(stage);
+}
+
+/*
+ * The last few seconds of decoded (pre-stretch) audio are kept in a ring,
+ * so that seeking back within them needs neither I/O nor decoding.
+ * Backends hand every decoded block to feed(), which appends it to the
+ * ring and plays from the read cursor up to the newest frame.  Other seeks
+ * are passed on to the backend's seek function.
+ *
+ * Blocks skimmed over or skipped leave gaps in the source, not in the
+ * ring: each run of contiguous source frames is a segment, which records
+ * the ring position it starts at and its source position.
+ */
+#define HISTORY_CHUNK 1024
+#define HISTORY_SEGMENTS 256
+
+static float historySeconds = 15;
+static struct {
+  SAMPLETYPE *buf;
+  unsigned long size;		/* capacity in frames */
+  long long start, end;		/* ring positions held */
+  long long cursor;		/* ring position of streamPos */
+  struct {
+    long long at;		/* ring position the segment starts at */
+    long long pos;		/* its source position */
+  } segment[HISTORY_SEGMENTS];
+  unsigned int first, segments;	/* oldest segment, number of segments */
+  unsigned long skimPos;	/* skim pattern position when played again */
+  long long skimAt;		/* ring position skimPos belongs to, if any */
+  unsigned long hits, misses;
+} history;
+
+#define SEGMENT(i) history.segment[(history.first + (i)) % HISTORY_SEGMENTS]
+
+/* Empty the ring, the next block fed starts a new segment */
+static void
+history_reset ()
+{
+  history.start = history.cursor = history.end;
+  history.segments = 0;
+}
+
+/* Index of the segment holding ring position AT */
+static unsigned int
+history_segment (long long at)
+{
+  unsigned int i = history.segments - 1;
+  while (i > 0 && SEGMENT(i).at > at) i--;
+  return i;
+}
+
+/* End of segment I, as a ring position */
+static long long
+history_segment_end (unsigned int i)
+{
+  return i + 1 < history.segments ? SEGMENT(i + 1).at : history.end;
+}
+
+/* Source position of ring position AT */
+static long long
+history_pos (long long at)
+{
+  unsigned int i = history_segment(at);
+  return SEGMENT(i).pos + (at - SEGMENT(i).at);
+}
+
+/*
+ * Ring position of source position TARGET, or of the first frame kept
+ * after it if it was skimmed over.  Returns -1 if the ring does not hold it.
+ */
+static long long
+history_find (long long target)
+{
+  if (!history.segments || target < SEGMENT(0).pos) return -1;
+  for (unsigned int i = 0; i < history.segments; i++) {
+    long long at = SEGMENT(i).at + (target - SEGMENT(i).pos);
+    if (at < SEGMENT(i).at) at = SEGMENT(i).at;	/* in the gap before */
+    if (at < history_segment_end(i) ||
+	(i == history.segments - 1 && at == history.end))
+      return at >= history.start ? at : -1;
+  }
+  return -1;
+}
+
+/*
+ * Backend seek, to absolute source position TARGET.
+ * Returns zero if the backend can not go there.
+ */
+typedef int (*BackendSeekFunc)(long long target);
+static BackendSeekFunc backendSeek;
+
+/* Decoders drop blocks ending before this position without decoding them */
+static long long skipTo = -1;
+
+static void
+history_setup ()
+{
+  unsigned int channels = source.channels;
+  history.end = 0;
+  history_reset();
+  free(history.buf);
+  history.buf = NULL;
+  history.size = (unsigned long)(historySeconds * source.rate);
+  if (memBudget && history.size * channels * sizeof(SAMPLETYPE) >
+		   memBudget / HISTORY_SHARE)
+    history.size = memBudget / HISTORY_SHARE / (channels * sizeof(SAMPLETYPE));
+  if (history.size && history.size < HISTORY_CHUNK)
+    history.size = HISTORY_CHUNK;
+  if (history.size &&
+      !(history.buf = (SAMPLETYPE *)malloc(history.size * channels *
+					   sizeof(SAMPLETYPE)))) {
+    fprintf(stderr, "Can not allocate %.0f seconds of history\n",
+	    historySeconds);
+    history.size = 0;
+  }
+}
+
+/*
+ * The decoders call this for every block.  A new rate or channel count
+ * sets up the stretcher, skimming and, if WITH_HISTORY, the history.
+ */
+static void
+source_setup (unsigned int rate, unsigned int channels, int withHistory)
+{
+  if (rate == source.rate && channels == source.channels) return;
+  source.rate = rate;
+  source.channels = channels;
+  st->setSampleRate(rate);
+  st->setChannels(channels);
+  skim_setup();
+  if (withHistory) history_setup();
+}
+
+static void
+history_report ()
+{
+  if (history.hits + history.misses)
+    printf("%lu seeks served from history, %lu missed\n",
+	   history.hits, history.misses);
+  if (restretches)
+    printf("%lu tempo or pitch changes stretched again\n", restretches);
+}
+
+/*
+ * Called by the decoders before decoding a block of FRAMES source frames
+ * at source position POS.  Returns non-zero if the block should be dropped.
+ */
+static int
+drop_block (long long pos, unsigned long frames)
+{
+  if (pos + (long long)frames <= skipTo) {
+    skim.dropped = 1;
+    return 1;
+  }
+  return skim_block(frames);
+}
+
+/*
+ * Continue at source position TARGET.  Returns 1 if the ring holds it,
+ * 2 if the backend went there and zero if neither can.
+ */
+static int
+seek_to (long long target)
+{
+  long long at = history.buf ? history_find(target) : -1;
+  if (at >= 0) {
+    history.cursor = at;
+    streamPos = history_pos(at);
+    if (skim.drop) {
+      /* Line the pattern up with the chunk kept when it was fed */
+      long long into = at - SEGMENT(history_segment(at)).at;
+      history.skimPos = into < (long long)skim.keep ? into : 0;
+      history.skimAt = -1;
+    }
+    return 1;
+  }
+  if (backendSeek && backendSeek(target)) {
+    /* The backend continues at target, the ring restarts there */
+    if (history.buf) history_reset();
+    streamPos = target;
+    return 2;
+  }
+  return 0;
+}
+
+static void
+seek_stream (float delta)
+{
+  long long target = streamPos + (long long)(delta * source.rate);
+  if (target < 0) target = 0;
+  int how = seek_to(target);
+  if (history.buf) {
+    if (how == 1) history.hits++;
+    else history.misses++;
+  }
+  if (!how && verbosity) {
+    printf("Can not seek %s\n", delta < 0 ? "back that far" : "forward");
+    fflush(stdout);
+  }
+}
+
+static void
+feed (long long pos, SAMPLETYPE *samples, unsigned int frames)
+{
+  unsigned int channels = source.channels;
+  int stage = set_stage(STAGE_HISTORY);
+  if (!history.buf) {
+    streamPos = pos;
+    stretch_and_play(samples, frames, channels, skim_cut());
+    set_stage(stage);
+    return;
+  }
+  long long live = history.end;	/* older frames are played again */
+  if (!history.segments || pos < history_pos(history.end - 1) + 1) {
+    /* A backend seek or the first block, start over */
+    history_reset();
+    live = history.end;
+  }
+  if (!history.segments || pos != history_pos(history.end - 1) + 1) {
+    /* Skimmed or skipped, start a new segment */
+    if (history.segments == HISTORY_SEGMENTS) {
+      history.first = (history.first + 1) % HISTORY_SEGMENTS;
+      history.segments--;
+      if (history.start < SEGMENT(0).at) history.start = SEGMENT(0).at;
+    }
+    SEGMENT(history.segments).at = history.end;
+    SEGMENT(history.segments).pos = pos;
+    history.segments++;
+  }
+  while (frames > 0) {
+    unsigned long off = history.end % history.size;
+    unsigned long n = history.size - off < frames ? history.size - off : frames;
+    memcpy(history.buf + off * channels, samples,
+	   n * channels * sizeof(SAMPLETYPE));
+    count_copy(STAGE_HISTORY, n * channels * sizeof(SAMPLETYPE));
+    history.end += n;
+    samples += n * channels;
+    frames -= n;
+  }
+  if (history.end - history.start > (long long)history.size)
+    history.start = history.end - history.size;
+  while (history.segments > 1 && SEGMENT(1).at <= history.start) {
+    history.first = (history.first + 1) % HISTORY_SEGMENTS;
+    history.segments--;
+  }
+  if (history.cursor < history.start)
+    history.cursor = history.start;
+  while (history.cursor < history.end && !quit) {
+    unsigned int i = history_segment(history.cursor);
+    unsigned long off = history.cursor % history.size;
+    unsigned long n = history_segment_end(i) - history.cursor;
+    if (n > history.size - off) n = history.size - off;
+    if (n > HISTORY_CHUNK) n = HISTORY_CHUNK;
+    streamPos = history_pos(history.cursor);
+    /* Live frames follow the decoder's pattern, from the block's end on */
+    int cut = history.cursor + (long long)n == history.end && skim_cut();
+    if (history.cursor < live && skim.drop) {
+      /*
+       * Played again, so the decoder did not skim it: apply the pattern
+       * here, including to the source frames skimmed when it was fed.
+       * The decoder keeps its own pattern position for new blocks.
+       */
+      unsigned long period = skim.keep + skim.drop;
+      if (history.skimAt == history.cursor && i > 0 &&
+	  history.cursor == SEGMENT(i).at) {
+	history.skimPos = (history.skimPos + streamPos -
+			   history_pos(history.cursor - 1) - 1) % period;
+	skim.dropped = 1;
+      }
+      int drop = history.skimPos >= skim.keep;
+      unsigned long phase = (drop ? period : skim.keep) - history.skimPos;
+      if (n > phase) n = phase;
+      if (history.cursor + (long long)n > live) n = live - history.cursor;
+      history.skimPos = (history.skimPos + n) % period;
+      history.skimAt = history.cursor + n;
+      /* The replayed pattern drops next, or the next segment is a gap */
+      cut = history.skimPos >= skim.keep ||
+	    (history.cursor + (long long)n == history_segment_end(i) &&
+	     i + 1 < history.segments);
+      if (drop) {
+	skim.dropped = 1;
+	history.cursor += n;
+	continue;
+      }
+    }
+    SAMPLETYPE block[n * channels];
+    memcpy(block, history.buf + off * channels,
+	   n * channels * sizeof(SAMPLETYPE));
+    count_copy(STAGE_HISTORY, n * channels * sizeof(SAMPLETYPE));
+    stretch_and_play(block, n, channels, cut);
+    history.cursor += n;
+    if (history.cursor < history.end)
+      pollKeyboard(seek_stream);
+  }
+  set_stage(stage);
+}
+
+/*
+ * At the end of input, play what the stretcher still holds, including a
+ * skim tail held back for a crossfade that will not come.
+ */
+static void
+stretch_flush ()
+{
+  if (quit || !audio_device || !source.channels) return;
+  int stage = set_stage(STAGE_STRETCH);
+  double cpu = thread_cpu();
+  if (skim.tailFrames) {
+    st->putSamples(skimTail, skim.tailFrames);
+    inFrames += skim.tailFrames;
+    skim.tailFrames = 0;
+  }
+  st->flush();
+  stretchCpu += thread_cpu() - cpu;
+  set_stage(STAGE_OUTPUT);
+  play_ao(source.channels, 1);
+  set_stage(stage);
+}
 
-static int
-initTTY ()
+/*
+ * All backends read their input through here.  A reader thread keeps up
+ * to a window of data ahead of the decoder, so that slow storage (NFS)
+ * shows up as a stall report rather than as a dropout in the middle of a
+ * decode.  Data is read into a ring of window bytes, or, once a backend
+ * has mapped the file itself, the reader faults in the pages ahead of it.
+ * --io-delay makes every read slow, to test all this locally.
+ */
+#define INPUT_CHUNK (64 << 10)
+
+static struct {
+  int fd;
+  int seekable;
+  off_t length;			/* -1 if unknown */
+  unsigned char *ring;
+  size_t window;
+  unsigned char const *map;	/* if set, prefault this mapping instead */
+  off_t start;			/* lowest offset read since the last restart */
+  off_t pos;			/* consumer position */
+  off_t fetched;		/* data is available up to here */
+  off_t released;		/* --mem-budget: dropped from memory up to here */
+  int eof, done;
+  int busy;			/* the reader is reading without the lock */
+  unsigned int generation;	/* bumped on every restart */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake, ready;
+  int delay;			/* artificial latency per read, in ms */
+  unsigned long stalls;
+  double stallTime;
+} reader = { -1 };
+
+static void *
+input_reader (void *data)
 {
-  SLtt_get_terminfo();
-  if (SLkp_init() != -1) {
-    if (SLang_init_tty(-1,0,1) != -1) {
-      return 1;
+  size_t page = sysconf(_SC_PAGESIZE);
+  set_stage(STAGE_INPUT);
+  pthread_mutex_lock(&reader.lock);
+  while (!reader.done) {
+    off_t behind = (reader.pos - (off_t)reader.window) & ~(off_t)(page - 1);
+    if (memBudget && reader.seekable && behind >= reader.released + INPUT_CHUNK) {
+      /* Drop what lies a window behind the consumer from the page cache */
+      off_t from = reader.released;
+      unsigned char const *map = reader.map;
+      reader.released = behind;
+      reader.busy = 1;
+      pthread_mutex_unlock(&reader.lock);
+      if (map)
+	madvise((void *)(map + from), behind - from, MADV_DONTNEED);
+      posix_fadvise(reader.fd, from, behind - from, POSIX_FADV_DONTNEED);
+      pthread_mutex_lock(&reader.lock);
+      reader.busy = 0;
+      pthread_cond_broadcast(&reader.ready);
+      continue;
+    }
+    off_t limit = reader.pos + reader.window;
+    if (reader.length >= 0 && limit > reader.length) limit = reader.length;
+    if (reader.eof || reader.fetched >= limit) {
+      pthread_cond_wait(&reader.wake, &reader.lock);
+      continue;
+    }
+    off_t off = reader.fetched;
+    size_t n = limit - off < INPUT_CHUNK ? limit - off : INPUT_CHUNK;
+    unsigned int generation = reader.generation;
+    unsigned char const *map = reader.map;
+    ssize_t got;
+    reader.busy = 1;
+    pthread_mutex_unlock(&reader.lock);
+    if (reader.delay) usleep(reader.delay * 1000);
+    if (map) {
+      volatile unsigned char touch;
+      for (off_t p = off & ~(off_t)(page - 1); p < off + (off_t)n; p += page)
+	touch = map[p];
+      (void)touch;
+      got = n;
     } else {
-      SLang_verror(SL_Open_Error, "Slang_init_tty failed.");
+      size_t at = off % reader.window;
+      if (n > reader.window - at) n = reader.window - at;
+      do {
+	got = reader.seekable ? pread(reader.fd, reader.ring + at, n, off)
+			      : read(reader.fd, reader.ring + at, n);
+      } while (got == -1 && errno == EINTR);
+    }
+    if (!map && got > 0) count_copy(STAGE_INPUT, got);
+    pthread_mutex_lock(&reader.lock);
+    reader.busy = 0;
+    pthread_cond_broadcast(&reader.ready);
+    if (generation != reader.generation)
+      continue;			/* the consumer moved, data is stale */
+    if (got <= 0) {
+      if (got == -1) perror("read");
+      reader.eof = 1;
+    } else {
+      reader.fetched += got;
     }
-  } else {
-    SLang_verror(SL_Open_Error, "SLkp_init failed.");
   }
-  return 0;
+  pthread_mutex_unlock(&reader.lock);
+  return NULL;
 }
 
-static char quit = 0;
-static float tempo = 1.0;
-static int pitchCentDelta = 0;
+static int
+input_open (int fd, size_t window)
+{
+  struct stat stat;
+  if (fstat(fd, &stat) == -1) return 0;
+  reader.fd = fd;
+  reader.seekable = S_ISREG(stat.st_mode);
+  reader.length = reader.seekable ? stat.st_size : -1;
+  reader.window = window < 2 * INPUT_CHUNK ? 2 * INPUT_CHUNK : window;
+  if (!(reader.ring = (unsigned char *)malloc(reader.window))) return 0;
+  pthread_mutex_init(&reader.lock, NULL);
+  pthread_cond_init(&reader.wake, NULL);
+  pthread_cond_init(&reader.ready, NULL);
+  if (pthread_create(&reader.thread, NULL, input_reader, NULL) != 0) {
+    free(reader.ring);
+    reader.ring = NULL;
+    return 0;
+  }
+  return 1;
+}
 
-using namespace soundtouch;
+/* Called with the lock held */
+static void
+input_wait (off_t end)
+{
+  if (reader.length >= 0 && end > reader.length) end = reader.length;
+  if (reader.fetched >= end || reader.eof) return;
+  double start = now();
+  reader.stalls++;
+  while (reader.fetched < end && !reader.eof)
+    pthread_cond_wait(&reader.ready, &reader.lock);
+  reader.stallTime += now() - start;
+}
 
-static class SoundTouch *st;
+/* Called with the lock held */
+static void
+input_restart (off_t target)
+{
+  reader.start = reader.pos = reader.fetched = target;
+  if (target < reader.released) reader.released = 0;
+  reader.eof = 0;
+  reader.generation++;
+}
 
-typedef void (*SeekFunc)(float delta);
+/*
+ * Like fread, only short at end of file.
+ */
+static size_t
+input_read (void *buf, size_t n)
+{
+  unsigned char *dst = (unsigned char *)buf;
+  size_t done = 0;
+  pthread_mutex_lock(&reader.lock);
+  while (done < n) {
+    input_wait(reader.pos + 1);
+    if (reader.fetched <= reader.pos) break;
+    size_t at = reader.pos % reader.window;
+    size_t chunk = reader.fetched - reader.pos;
+    if (chunk > n - done) chunk = n - done;
+    if (chunk > reader.window - at) chunk = reader.window - at;
+    memcpy(dst + done, reader.ring + at, chunk);
+    count_copy(STAGE_INPUT, chunk);
+    reader.pos += chunk;
+    done += chunk;
+    pthread_cond_signal(&reader.wake);
+  }
+  pthread_mutex_unlock(&reader.lock);
+  return done;
+}
 
-static void
-pollKeyboard (SeekFunc seekfunc)
+static off_t
+input_seek (off_t offset, int whence)
 {
-  if (SLang_input_pending(0) != 0) {
-    switch (SLkp_getkey()) {
-    case 'l':
-    case SL_KEY_RIGHT:
-      if (seekfunc)
-	seekfunc(5);
-      else
-	if (verbosity) {
-	  printf("Seeking not implemented for this backend\n");
-	  fflush(stdout);
-	}
-      break;
-    case 'h':
-    case SL_KEY_LEFT:
-      if (seekfunc)
-	seekfunc(-5);
-      else
-	if (verbosity) {
-	  printf("Seeking not implemented for this backend\n");
-	  fflush(stdout);
-	}
-      break;
-    case '+':
-      if (tempo < 5.)
-	st->setTempo(tempo += .01);
-      break;
-    case '-':
-      if (tempo > 0.02)
-	st->setTempo(tempo -= .01);
-      break;
-    case 'c':
-      st->setPitch(powf(2.,(pitchCentDelta -= 1)/1200.));
-      break;
-    case 'C':
-      if (pitchCentDelta < 4800)
-	st->setPitch(powf(2.,(pitchCentDelta += 1)/1200.));
-      break;
-    case 's':
-    case SL_KEY_DOWN:
-      st->setPitch(powf(2.,(pitchCentDelta -= 100)/1200.));
-      break;
-    case 'S':
-    case SL_KEY_UP:
-      if (pitchCentDelta < 4701)
-	st->setPitch(powf(2.,(pitchCentDelta += 100)/1200.));
-      else
-	st->setPitch(powf(2.,(pitchCentDelta = 4800)/1200.));
-      break;
-    case 'q':
-    case SL_KEY_F(10):
-      quit = 1;
-      break;
-    }
-    if (!quit && verbosity > 0) {
-      printf("%3.0f%% speed %7d cents\r", tempo*100, pitchCentDelta);
-      fflush(stdout);
-    }
+  off_t target = offset;
+  if (whence == SEEK_CUR) target += reader.pos;
+  else if (whence == SEEK_END) {
+    if (reader.length < 0) return -1;
+    target += reader.length;
   }
+  if (target < 0) return -1;
+  pthread_mutex_lock(&reader.lock);
+  /* Data behind pos survives until the reader wraps around to it */
+  off_t oldest = reader.fetched + INPUT_CHUNK - (off_t)reader.window;
+  if (oldest < reader.start) oldest = reader.start;
+  if (reader.map ? target >= reader.pos && target <= reader.fetched
+		 : target >= oldest && target <= reader.fetched) {
+    reader.pos = target;
+  } else if (reader.seekable) {
+    input_restart(target);
+  } else {
+    target = -1;
+  }
+  pthread_cond_signal(&reader.wake);
+  pthread_mutex_unlock(&reader.lock);
+  return target;
 }
 
-static struct sigaction save_sigint, save_sigtstp;
-static void signal_handler (int signal);
+static off_t
+input_tell ()
+{
+  return reader.pos;
+}
 
-static int audio_driver;
-static ao_device *audio_device;
-static ao_sample_format audio_format;
+static int
+input_eof ()
+{
+  int eof;
+  pthread_mutex_lock(&reader.lock);
+  input_wait(reader.pos + 1);
+  eof = reader.fetched <= reader.pos;
+  pthread_mutex_unlock(&reader.lock);
+  return eof;
+}
 
+/*
+ * Switch to prefaulting MAP, the consumer accesses it directly and calls
+ * input_need() before touching a range.  Switch back with NULL before
+ * unmapping.
+ */
 static void
-play_ao (int channels, int bufsize)
+input_map (unsigned char const *map)
 {
-  SAMPLETYPE samples[bufsize * channels];
-  SAMPLETYPE *ptr;
-  char buffer[bufsize * channels * sizeof(signed int)];
-  char *byte;
-  int outSamples;
-  do {
-    ptr = samples;
-    byte = buffer;
-    outSamples = st->receiveSamples(samples, bufsize);
-    for (int i = 0; i < outSamples; i++) {
-      signed int sample;
-      for (int c = 0; c < channels; c++) {
-	sample = (int)*ptr++;
-	*byte++ = (sample >> 0) & 0xff;
-	*byte++ = (sample >> 8) & 0xff;
-      }
+  pthread_mutex_lock(&reader.lock);
+  while (reader.busy)
+    pthread_cond_wait(&reader.ready, &reader.lock);
+  reader.map = map;
+  input_restart(reader.pos);
+  pthread_cond_signal(&reader.wake);
+  pthread_mutex_unlock(&reader.lock);
+}
+
+static void
+input_need (off_t from, off_t to)
+{
+  pthread_mutex_lock(&reader.lock);
+  if (from < reader.pos || from > reader.fetched)
+    input_restart(from);
+  reader.pos = from;
+  pthread_cond_signal(&reader.wake);
+  input_wait(to);
+  pthread_mutex_unlock(&reader.lock);
+}
+
+static void
+input_close ()
+{
+  if (!reader.ring) return;
+  pthread_mutex_lock(&reader.lock);
+  reader.done = 1;
+  pthread_cond_signal(&reader.wake);
+  pthread_mutex_unlock(&reader.lock);
+  pthread_join(reader.thread, NULL);
+  free(reader.ring);
+  reader.ring = NULL;
+}
+
+static void
+input_report ()
+{
+  printf("input: %lu stalls, %.3f s stalled\n",
+	 reader.stalls, reader.stallTime);
+}
+
+/*
+ * Print peak RSS and how much of the input is in the page cache.
+ * Returns zero if peak RSS exceeded --mem-budget.
+ */
+static int
+memory_report ()
+{
+  struct rusage usage;
+  size_t page = sysconf(_SC_PAGESIZE), cached = 0;
+  getrusage(RUSAGE_SELF, &usage);
+  if (reader.seekable) {
+    /* In pieces, a whole file might not fit into a small address space */
+    size_t piece = 64 << 20;
+    for (off_t off = 0; off < reader.length; off += piece) {
+      size_t length = reader.length - off < (off_t)piece ? reader.length - off : piece;
+      unsigned char vec[(length + page - 1) / page];
+      void *map = mmap(0, length, PROT_READ, MAP_SHARED, reader.fd, off);
+      if (map == MAP_FAILED) break;
+      if (mincore(map, length, vec) == 0)
+	for (size_t i = 0; i < sizeof(vec); i++)
+	  cached += vec[i] & 1;
+      munmap(map, length);
     }
-    if (byte-buffer > 0)
-      ao_play(audio_device, buffer, byte-buffer);
-  } while (outSamples != 0);
+  }
+  printf("peak RSS %.1f MiB, %.1f MiB of input in the page cache",
+	 usage.ru_maxrss / 1024., cached * page / 1048576.);
+  if (memBudget)
+    printf(", budget %.1f MiB", memBudget / 1048576.);
+  printf("\n");
+  return !memBudget || (size_t)usage.ru_maxrss << 10 <= memBudget;
 }
 
 static void print_version();
@@ -171,14 +2270,107 @@ static int play_speex(int fd, char *begin);
 static int play_sndfile (int fd, char const *begin, char const *end);
 static int play_mpeg(int fd, char *begin, char *end);
 
+enum {
+  OPT_RECORD_KEYS = 256,
+  OPT_REPLAY_KEYS,
+  OPT_TEE,
+  OPT_ENGINE,
+  OPT_HISTORY,
+  OPT_READAHEAD,
+  OPT_IO_DELAY,
+  OPT_SILENCE,
+  OPT_SILENCE_THRESHOLD,
+  OPT_RATE,
+  OPT_RESAMPLE_QUALITY,
+  OPT_RESPONSIVE,
+  OPT_MEM_BUDGET
+};
+
+static struct option const long_options[] = {
+  { "quiet", no_argument, NULL, 'q' },
+  { "verbose", no_argument, NULL, 'v' },
+  { "version", no_argument, NULL, 'V' },
+  { "help", no_argument, NULL, 'h' },
+  { "record-keys", required_argument, NULL, OPT_RECORD_KEYS },
+  { "replay-keys", required_argument, NULL, OPT_REPLAY_KEYS },
+  { "tee", required_argument, NULL, OPT_TEE },
+  { "engine", required_argument, NULL, OPT_ENGINE },
+  { "history", required_argument, NULL, OPT_HISTORY },
+  { "readahead", required_argument, NULL, OPT_READAHEAD },
+  { "io-delay", required_argument, NULL, OPT_IO_DELAY },
+  { "silence", required_argument, NULL, OPT_SILENCE },
+  { "silence-threshold", required_argument, NULL, OPT_SILENCE_THRESHOLD },
+  { "rate", required_argument, NULL, OPT_RATE },
+  { "resample-quality", required_argument, NULL, OPT_RESAMPLE_QUALITY },
+  { "responsive", no_argument, NULL, OPT_RESPONSIVE },
+  { "mem-budget", required_argument, NULL, OPT_MEM_BUDGET },
+  { NULL, 0, NULL, 0 }
+};
+
 int
 main (int argc, char *argv[])
 {
   int c;
   char *input_file = NULL;
   char *begin_time = NULL, *end_time = NULL;
-  while ((c = getopt(argc, argv, "b:e:c:s:qt:vVh")) != -1) {
+  char const *engine = "soundtouch";
+  size_t readahead = 4 << 20;
+  while ((c = getopt_long(argc, argv, "b:e:c:s:qt:vVh",
+			  long_options, NULL)) != -1) {
     switch (c) {
+    case OPT_RECORD_KEYS:
+      if (!(recordFile = fopen(optarg, "w"))) {
+	fprintf(stderr, "Can not open %s: %s, aborting...\n", optarg, strerror(errno));
+	exit(EXIT_FAILURE);
+      }
+      fprintf(recordFile, "# yatm key log: position wall-time key\n");
+      break;
+    case OPT_REPLAY_KEYS:
+      if (!load_events(optarg))
+	exit(EXIT_FAILURE);
+      replaying = 1;
+      break;
+    case OPT_TEE:
+      teeSink.filename = optarg;
+      break;
+    case OPT_ENGINE:
+      engine = optarg;
+      break;
+    case OPT_HISTORY:
+      historySeconds = atof(optarg);
+      break;
+    case OPT_READAHEAD:
+      readahead = (size_t)atol(optarg) << 10;
+      break;
+    case OPT_IO_DELAY:
+      reader.delay = atoi(optarg);
+      break;
+    case OPT_SILENCE:
+      if (!parse_silence(optarg)) {
+	fprintf(stderr, "Invalid silence mode %s, aborting...\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case OPT_SILENCE_THRESHOLD:
+      silence.threshold = atof(optarg);
+      break;
+    case OPT_RATE:
+      resampler.outRate = atoi(optarg);
+      break;
+    case OPT_RESAMPLE_QUALITY:
+      for (resampler.quality = 2; resampler.quality >= 0; resampler.quality--)
+	if (!strcmp(optarg, resampleQualities[resampler.quality])) break;
+      if (resampler.quality < 0) {
+	fprintf(stderr, "Unknown resample quality %s, aborting...\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case OPT_RESPONSIVE:
+      responsive = 1;
+      break;
+    case OPT_MEM_BUDGET:
+      memBudget = (size_t)(atof(optarg) * 1048576);
+      break;
     case 'b':
       begin_time = strdup(optarg);
       break;
@@ -204,7 +2396,14 @@ main (int argc, char *argv[])
       print_version();
       return 0;
     case 'h':
-      printf("%s [-b TIME] [-e TIME] [-t RATIO] [-s SEMITONES] [-c CENTS] FILENAME\n", argv[0]);
+      printf("%s [-b TIME] [-e TIME] [-t RATIO] [-s SEMITONES] [-c CENTS]\n"
+	     "     [--record-keys FILE] [--replay-keys FILE] [--tee FILE]\n"
+	     "     [--engine soundtouch|pvoc] [--history SECONDS]\n"
+	     "     [--readahead KIB] [--io-delay MS]\n"
+	     "     [--silence speed[:TEMPO]|trim[:SECONDS]] [--silence-threshold DB]\n"
+	     "     [--rate HZ] [--resample-quality low|medium|high] [--responsive]\n"
+	     "     [--mem-budget MIB]\n"
+	     "     FILENAME\n", argv[0]);
       exit(EXIT_FAILURE);
     }
   }
@@ -219,8 +2418,16 @@ main (int argc, char *argv[])
     std::cout << "No input file specified, aborting..." << std::endl;
     exit(EXIT_FAILURE);
   }
+  silence_thresholds();
 
-  st = new SoundTouch();
+  if (!strcmp(engine, "soundtouch")) {
+    st = new SoundTouchStretcher();
+  } else if (!strcmp(engine, "pvoc")) {
+    st = new PhaseVocoder();
+  } else {
+    fprintf(stderr, "Unknown engine %s, aborting...\n", engine);
+    exit(EXIT_FAILURE);
+  }
 
   struct sigaction action;
 
@@ -229,9 +2436,18 @@ main (int argc, char *argv[])
     fprintf(stderr, "Can not open %s: %s, aborting...\n", input_file, strerror(errno));
     exit(EXIT_FAILURE);
   }
+  if (memBudget && readahead > memBudget / READAHEAD_SHARE)
+    readahead = memBudget / READAHEAD_SHARE;
+  if (!input_open(fd, readahead)) {
+    fprintf(stderr, "Can not start reading %s, aborting...\n", input_file);
+    exit(EXIT_FAILURE);
+  }
 
   ao_initialize();
-  audio_driver = ao_default_driver_id();
+  /* Replays are benchmarks, keep them headless */
+  audio_driver = replaying ? ao_driver_id("null") : ao_default_driver_id();
+  /* Without a device to keep up with, --tee renders every block */
+  teeSink.wait = replaying;
 
   if (sigaction(SIGTSTP, 0, &save_sigtstp) == -1) {
     fprintf(stderr, "Error saving sigtstp handler.\n");
@@ -260,20 +2476,54 @@ main (int argc, char *argv[])
     return 0;
   }
 
-  initTTY();
-  st->setSetting(SETTING_USE_QUICKSEEK, 0);
-  st->setSetting(SETTING_USE_AA_FILTER, 1);
+  if (!replaying)
+    initTTY();
   st->setPitch(powf(2.,pitchCentDelta/1200.));
-  st->setTempo(tempo);
+  set_tempo(tempo);
+  startTime = now();
   if (!play_sndfile(fd, begin_time, end_time))
     if (!play_speex(fd, begin_time))
       play_mpeg(fd, begin_time, end_time);
 
   if (begin_time) free(begin_time);
   if (end_time) free(end_time);
+  input_close();
+  int withinBudget = 1;
+  if (memBudget || verbosity > 1)
+    withinBudget = memory_report();
   close(fd);
+  tee_close();
+  if (replaying && verbosity > 0)
+    bench_report(source.rate);
+  if (verbosity > 0) {
+    history_report();
+    silence_report();
+  }
+  if (verbosity > 1 || (replaying && verbosity > 0))
+    input_report();
+  free(history.buf);
+  free(resampler.filter);
+  free(resampler.in);
   delete st;
-  SLang_reset_tty();
+  if (!replaying)
+    SLang_reset_tty();
+  if (recordFile)
+    fclose(recordFile);
+  if (nEvents && verbosity > 0) {
+    printf("\n");
+    latency_report(source.rate);
+  }
+  free(events);
+  if (alloc_report()) {
+    fprintf(stderr, "Steady state playback allocated memory.\n");
+    return EXIT_FAILURE;
+  }
+  if (resampler.overBudget)
+    return EXIT_FAILURE;
+  if (!withinBudget) {
+    fprintf(stderr, "Peak RSS exceeded the memory budget.\n");
+    return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
 }
 
@@ -281,16 +2531,20 @@ main (int argc, char *argv[])
 /*
  * Private message structure for MAD decoder.
  */
+#define MPEG_BUFSIZE (64 << 10)
+
 struct player {
 #define PLAYER_OPTION_SKIP  0x01
 #define PLAYER_OPTION_TIMED 0x02
   int options;
-  unsigned char const *start;
-  unsigned long length;
+  unsigned char buffer[MPEG_BUFSIZE + MAD_BUFFER_GUARD];
+  off_t offset;			/* file offset of buffer */
+  int eof;
   mad_timer_t absolute_time;
   mad_timer_t playback_time;
   mad_timer_t start_time;
   mad_timer_t duration;
+  long long pos;		/* source position of the current frame */
 };
 
 /*
@@ -300,13 +2554,26 @@ static enum mad_flow
 input (void *data, struct mad_stream *stream)
 {
   struct player *player = (struct player *)data;
+  size_t keep = 0, n;
 
-  if (!player->length)
+  if (player->eof)
     return MAD_FLOW_STOP;
 
-  mad_stream_buffer(stream, player->start, player->length);
+  /* Keep the incomplete frame at the end of the last buffer */
+  if (stream->next_frame) {
+    keep = stream->bufend - stream->next_frame;
+    memmove(player->buffer, stream->next_frame, keep);
+  }
+  player->offset = input_tell() - keep;
+  n = input_read(player->buffer + keep, MPEG_BUFSIZE - keep);
+  if (n == 0) {
+    /* The guard lets libmad decode the last frame */
+    memset(player->buffer + keep, 0, MAD_BUFFER_GUARD);
+    n = MAD_BUFFER_GUARD;
+    player->eof = 1;
+  }
 
-  player->length = 0;
+  mad_stream_buffer(stream, player->buffer, keep + n);
 
   return MAD_FLOW_CONTINUE;
 }
@@ -323,6 +2590,8 @@ decode_header (void *data, struct mad_header const *header)
       mad_timer_compare(player->playback_time, player->duration) > 0)
     return MAD_FLOW_STOP;
 
+  player->pos = mad_timer_count(player->absolute_time,
+				(enum mad_units)header->samplerate);
   mad_timer_add(&player->absolute_time, header->duration);
 
   if ((player->options & PLAYER_OPTION_SKIP) &&
@@ -330,6 +2599,8 @@ decode_header (void *data, struct mad_header const *header)
     return MAD_FLOW_IGNORE;
 
   mad_timer_add(&player->playback_time, header->duration);
+  if (drop_block(player->pos, 32 * MAD_NSBSAMPLES(header)))
+    return MAD_FLOW_IGNORE;
   return MAD_FLOW_CONTINUE;
 }
 
@@ -342,7 +2613,7 @@ decode_filter (
   struct mad_stream const *stream,
   struct mad_frame *frame
 ) {
-  pollKeyboard(NULL);
+  pollKeyboard(seek_stream);
   if (quit)
     return MAD_FLOW_STOP;
   else
@@ -395,9 +2666,9 @@ process_output (
   if (!audio_device) {
     audio_format.bits = 16;
     audio_format.channels = nchannels;
-    audio_format.rate = rate;
+    audio_format.rate = device_rate(rate);
     audio_format.byte_format = AO_FMT_LITTLE;
-    audio_device = ao_open_live(audio_driver, &audio_format, NULL);
+    audio_device = open_device();
     if (!audio_device) {
       fprintf(stderr, "Error opening audio device.\n");
       return MAD_FLOW_BREAK;
@@ -413,10 +2684,9 @@ process_output (
       *ptr++ = sample;
     }
   }
-  st->setSampleRate(rate);
-  st->setChannels(nchannels);
-  st->putSamples(samples, inSamples);
-  play_ao(nchannels, inSamples);
+  source_setup(rate, nchannels, 1);
+  count_copy(STAGE_DECODE, nchannels * inSamples * sizeof(SAMPLETYPE));
+  feed(((struct player *)data)->pos, samples, inSamples);
   return MAD_FLOW_CONTINUE;
 }
 
@@ -432,9 +2702,13 @@ decode_error (void *data, struct mad_stream *stream, struct mad_frame *frame)
 {
   struct player *player = (struct player *)data;
 
+  /* Layer III frames following a skimmed gap lack their bit reservoir */
+  if (skim.dropped && stream->error == MAD_ERROR_BADDATAPTR)
+    return MAD_FLOW_CONTINUE;
+
   fprintf(stderr, "decoding error 0x%04x (%s) at byte offset %ld\n",
 	  stream->error, mad_stream_errorstr(stream),
-	  stream->this_frame - player->start);
+	  (long)(player->offset + (stream->this_frame - player->buffer)));
 
   /* return MAD_FLOW_BREAK here to stop decoding (and propagate an error) */
 
@@ -522,6 +2796,17 @@ parse_mad_time (mad_timer_t *timer, char const *str)
   return 0;
 }
 
+/*
+ * MPEG can only skip forward, going back is left to the history ring.
+ */
+static int
+seek_mpeg (long long target)
+{
+  if (target < streamPos) return 0;
+  skipTo = target;
+  return 1;
+}
+
 /*
  * This is the function called by main() above to perform all the decoding.
  * It instantiates a decoder object and configures it with the input,
@@ -536,22 +2821,11 @@ play_mpeg(int fd, char *begin, char *end)
 {
   struct player player;
   struct mad_decoder decoder;
-  struct stat stat;
-  void *fdm;
   int result;
-  if (fstat(fd, &stat) == -1 ||
-      stat.st_size == 0)
-    return 0;
-
-  fdm = mmap(0, stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
-  if (fdm == MAP_FAILED) {
-    fprintf(stderr, "mmap failed, aborting...\n");
-    return 0;
-  }
 
   player.options = 0;
-  player.start = (unsigned char *)fdm;
-  player.length = stat.st_size;
+  player.offset = 0;
+  player.eof = 0;
   player.absolute_time = player.playback_time = player.start_time =
     player.duration = mad_timer_zero;
   if (begin) {
@@ -570,15 +2844,15 @@ play_mpeg(int fd, char *begin, char *end)
     fprintf(stderr, "Setting end to %s\n", end);
     player.options |= PLAYER_OPTION_TIMED;
   }
+  backendSeek = seek_mpeg;
   mad_decoder_init(&decoder, &player,
 		   input, decode_header, decode_filter, process_output,
 		   decode_error, 0 /* message */);
 
   result = mad_decoder_run(&decoder, MAD_DECODER_MODE_SYNC);
   mad_decoder_finish(&decoder);
+  stretch_flush();
   ao_close(audio_device);
-  if (munmap((void *)player.start, stat.st_size) == -1)
-    return 4;
 
   return result;
 }
@@ -651,10 +2925,20 @@ print_version()
   fprintf(stderr, "YATM " YATM_VERSION "\n");
 }
 
+/*
+ * Speex, like MPEG, can only skip forward.
+ */
+static int
+seek_speex (long long target)
+{
+  if (target < streamPos) return 0;
+  skipTo = target;
+  return 1;
+}
+
 static int
 play_speex (int fd, char *begin)
 {
-  FILE *fin;
   int frame_size = 0, packet_count = 0, stream_init = 0;
   void *stc = NULL;
   SpeexBits bits;
@@ -674,24 +2958,22 @@ play_speex (int fd, char *begin)
   int extra_headers;
   float output[2000];
   
-  fin = fdopen(dup(fd), "rb");
-  if (!fin) {
-    perror("fdopen");
-    return 0;
-  }
   /* Init Ogg data structure */
   ogg_sync_init(&oy);
 
   speex_bits_init(&bits);
 
-  while (!feof(fin)) { /* Main decoding loop */
+  while (!input_eof()) { /* Main decoding loop */
     char *data = ogg_sync_buffer(&oy, 200);
     int i, j, nb_read;
 
     /* Read bitstream from input file */
-    nb_read = fread(data, sizeof(char), 200, fin);
+    nb_read = input_read(data, 200);
     ogg_sync_wrote(&oy, nb_read);
 
+    /* Do not read through all of some other kind of file */
+    if (!stream_init && input_tell() > 65536) break;
+
     /* Loop for all complete pages we got (most likely only one) */
     while (ogg_sync_pageout(&oy, &og) == 1) {
       if (!stream_init) {
@@ -710,8 +2992,7 @@ play_speex (int fd, char *begin)
 
 	  if (!(header = speex_packet_to_header((char*)op.packet, op.bytes))) {
 	    fprintf (stderr, "Cannot read Speex header.\n");
-	    rewind(fin);
-	    fclose(fin);
+	    input_seek(0, SEEK_SET);
 	    return 0;
 	  }
 	  if (header->mode >= SPEEX_NB_MODES) {
@@ -734,8 +3015,7 @@ play_speex (int fd, char *begin)
 	  }
 	  if (!(stc = speex_decoder_init(mode))) {
 	    fprintf (stderr, "Decoder initialization failed.\n");
-	    rewind(fin);
-	    fclose(fin);
+	    input_seek(0, SEEK_SET);
 	    return 0;
 	  }
 	  speex_decoder_ctl(stc, SPEEX_SET_ENH, &enhance_mode);
@@ -768,33 +3048,38 @@ play_speex (int fd, char *begin)
 	  if (!nframes) nframes = 1;
 	  audio_format.bits = 16;
 	  audio_format.channels = channels;
-	  audio_format.rate = rate;
+	  audio_format.rate = device_rate(rate);
 	  audio_format.byte_format = AO_FMT_LITTLE;
 	  if (audio_device) {
 	    fprintf(stderr, "Audio device already open.\n");
-	    fclose(fin);
 	    return 1;
 	  }
-	  audio_device = ao_open_live(audio_driver, &audio_format, NULL);
+	  audio_device = open_device();
 	  if (!audio_device) {
 	    fprintf(stderr, "Error opening audio device: %d.\n", errno);
-	    fclose(fin);
 	    return 1;
 	  }
-	  st->setSampleRate(rate);
-	  st->setChannels(channels);
+	  source_setup(rate, channels, 1);
+	  backendSeek = seek_speex;
 	} else if (packet_count == 1) {
 	  fprintf(stderr, "Ignoring comment packet.\n");
 	} else if (packet_count <= 1+extra_headers) {
 	  fprintf(stderr, "Ignoring extra headers.\n");
 	} else {
 	  int lost = 0;
-	  pollKeyboard(NULL);
+	  pollKeyboard(seek_stream);
 	  if (quit) goto close;
 
 	  if (loss_percent > 0 &&
 	      100 * ((float)rand())/RAND_MAX < loss_percent) lost = 1;
 	  if (op.e_o_s) eos = 1;
+	  if (total_samples >= skip_samples &&
+	      drop_block(total_samples, nframes * frame_size)) {
+	    /* Skimming, do not even decode this packet */
+	    total_samples += nframes * frame_size;
+	    packet_count++;
+	    continue;
+	  }
 	  /* Copy Ogg packet to Speex bitstream */
 	  speex_bits_read_from(&bits, (char*)op.packet, op.bytes);
 	  for (j=0; j!=nframes; j++) {
@@ -824,8 +3109,8 @@ play_speex (int fd, char *begin)
 		else if (sample < -32000) sample = -32000;
 		samples[i] = sample;
 	      }
-	      st->putSamples(samples, frame_size);
-	      play_ao(channels, frame_size);
+	      count_copy(STAGE_DECODE, frame_size * channels * sizeof(SAMPLETYPE));
+	      feed(total_samples, samples, frame_size);
 	    }
 	    total_samples+=frame_size;
 	  }
@@ -835,42 +3120,259 @@ play_speex (int fd, char *begin)
     }
   }
  close:
+  stretch_flush();
   if (stc) speex_decoder_destroy(stc);
   else {
     fprintf(stderr, "This doesn't look like a Speex file\n");
+    input_seek(0, SEEK_SET);
     return 0;
   }
   speex_bits_destroy(&bits);
   if (stream_init) ogg_stream_clear(&os);
   ogg_sync_clear(&oy);
-  fclose(fin);
   return 1;
 }
 
-#include <sndfile.h>
-
 SNDFILE *sndfile;
 SF_INFO sfinfo;
+static sf_count_t sndfilePos;
+
+static sf_count_t
+vio_get_filelen (void *data)
+{
+  return reader.length >= 0 ? reader.length : (sf_count_t)1 << 62;
+}
+
+static sf_count_t
+vio_seek (sf_count_t offset, int whence, void *data)
+{
+  return input_seek(offset, whence);
+}
+
+static sf_count_t
+vio_read (void *ptr, sf_count_t count, void *data)
+{
+  return input_read(ptr, count);
+}
+
+static sf_count_t
+vio_write (const void *ptr, sf_count_t count, void *data)
+{
+  return 0;
+}
+
+static sf_count_t
+vio_tell (void *data)
+{
+  return input_tell();
+}
+
+static SF_VIRTUAL_IO virtualInput = {
+  vio_get_filelen, vio_seek, vio_read, vio_write, vio_tell
+};
+
+static int
+seek_sndfile (long long target)
+{
+  sf_count_t pos = sf_seek(sndfile, target, SEEK_SET);
+  if (pos == -1) return 0;
+  sndfilePos = pos;
+  return 1;
+}
+
+/*
+ * Fast path for uncompressed 16 bit PCM (WAV and AIFF): the file is mapped
+ * and samples are taken straight from the mapping.  If SoundTouch was built
+ * for 16 bit integer samples and the byte order matches, SoundTouch is even
+ * handed pointers into the mapping.  The mapping is read-only, the skim
+ * crossfade is done in skimTail.
+ */
+#define PCM_BLOCK 2048
+
+static struct {
+  unsigned char *map;
+  size_t length;
+  short const *data;		/* first frame */
+  sf_count_t frames;
+  int swap;			/* samples are not in host byte order */
+} pcm;
+
+static unsigned long
+le32 (unsigned char const *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+static unsigned long
+be32 (unsigned char const *p)
+{
+  return (unsigned long)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/*
+ * Locate the sample data of a 16 bit PCM WAV or AIFF file libsndfile has
+ * already accepted.  Returns zero if the fast path does not apply.
+ */
+static int
+map_pcm (int fd)
+{
+  struct stat stat;
+  int subtype = sfinfo.format & SF_FORMAT_SUBMASK;
+  int type = sfinfo.format & SF_FORMAT_TYPEMASK;
+  unsigned char const *p, *data = NULL;
+  size_t off, bytes = 0;
+  int bigEndian;
+
+  /* Under a budget, the reader's window is all of the input we hold */
+  if (memBudget || subtype != SF_FORMAT_PCM_16 ||
+      (type != SF_FORMAT_WAV && type != SF_FORMAT_AIFF))
+    return 0;
+  if (fstat(fd, &stat) == -1 || stat.st_size < 12)
+    return 0;
+  pcm.length = stat.st_size;
+  pcm.map = (unsigned char *)mmap(0, pcm.length, PROT_READ,
+				  MAP_PRIVATE, fd, 0);
+  if (pcm.map == MAP_FAILED) {
+    pcm.map = NULL;
+    return 0;
+  }
+  p = pcm.map;
+  if (type == SF_FORMAT_WAV && !memcmp(p, "RIFF", 4) && !memcmp(p+8, "WAVE", 4)) {
+    for (off = 12; off + 8 <= pcm.length; off += 8 + le32(p+off+4) + (le32(p+off+4) & 1))
+      if (!memcmp(p+off, "data", 4)) {
+	data = p + off + 8;
+	bytes = le32(p+off+4);
+	break;
+      }
+    bigEndian = 0;
+  } else if (type == SF_FORMAT_AIFF && !memcmp(p, "FORM", 4) && !memcmp(p+8, "AIFF", 4)) {
+    for (off = 12; off + 16 <= pcm.length; off += 8 + be32(p+off+4) + (be32(p+off+4) & 1))
+      if (!memcmp(p+off, "SSND", 4)) {
+	data = p + off + 16 + be32(p+off+8);
+	bytes = be32(p+off+4) - 8 - be32(p+off+8);
+	break;
+      }
+    bigEndian = 1;
+  }
+  if (!data || data > p + pcm.length || ((data - p) & 1)) {
+    munmap(pcm.map, pcm.length);
+    pcm.map = NULL;
+    return 0;
+  }
+  if (bytes > (size_t)(p + pcm.length - data))
+    bytes = p + pcm.length - data;
+  pcm.data = (short const *)data;
+  pcm.frames = bytes / (2 * sfinfo.channels);
+  if (sfinfo.frames < pcm.frames) pcm.frames = sfinfo.frames;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  pcm.swap = !bigEndian;
+#else
+  pcm.swap = bigEndian;
+#endif
+  madvise(pcm.map, pcm.length, MADV_SEQUENTIAL);
+  input_map(pcm.map);
+  return 1;
+}
+
+/*
+ * Wait for the reader to have faulted in FRAMES frames at POS.
+ */
+static void
+pcm_need (sf_count_t pos, sf_count_t frames)
+{
+  off_t off = (unsigned char const *)(pcm.data + pos * sfinfo.channels) - pcm.map;
+  input_need(off, off + frames * sfinfo.channels * sizeof(short));
+}
+
+static void
+pcm_convert (SAMPLETYPE *__restrict__ dst, short const *__restrict__ src, int n)
+{
+  if (pcm.swap)
+    for (int i = 0; i < n; i++)
+      dst[i] = (short)((unsigned short)src[i] << 8 | (unsigned short)src[i] >> 8);
+  else
+    for (int i = 0; i < n; i++)
+      dst[i] = src[i];
+}
+
+static int
+seek_pcm (long long target)
+{
+  sndfilePos = target < pcm.frames ? target : pcm.frames;
+  return 1;
+}
 
 static void
-seek_sndfile (float delta)
+play_pcm (sf_count_t maxFrames)
 {
-  sf_seek(sndfile, (sf_count_t)(sfinfo.samplerate*delta), SEEK_CUR);
+  unsigned int channels = sfinfo.channels;
+  sf_count_t readFrames = 0;
+  backendSeek = seek_pcm;
+  while (!quit) {
+    sf_count_t gap = skim_gap();
+    if (gap) {
+      /* Skimming, nothing to decode, just move on */
+      skim_block(gap);
+      readFrames += gap;
+      sndfilePos += gap;
+    }
+    if (maxFrames && readFrames >= maxFrames) break;
+    if (sndfilePos >= pcm.frames) break;
+    sf_count_t nFrames = pcm.frames - sndfilePos;
+    if (nFrames > PCM_BLOCK) nFrames = PCM_BLOCK;
+    if (maxFrames && readFrames + nFrames > maxFrames)
+      nFrames = maxFrames - readFrames;
+    skim_block(nFrames);
+    pcm_need(sndfilePos, nFrames);
+    short const *src = pcm.data + sndfilePos * channels;
+    SAMPLETYPE buf[nFrames * channels];
+    SAMPLETYPE const *samples = buf;
+#ifdef SOUNDTOUCH_INTEGER_SAMPLES
+    if (!pcm.swap)
+      samples = src;		/* zero copy */
+    else
+#endif
+    {
+      pcm_convert(buf, src, nFrames * channels);
+      count_copy(STAGE_DECODE, nFrames * channels * sizeof(SAMPLETYPE));
+    }
+    streamPos = sndfilePos;
+    readFrames += nFrames;
+    sndfilePos += nFrames;
+    stretch_and_play(samples, nFrames, channels, skim_cut());
+    pollKeyboard(seek_stream);
+  }
+  input_map(NULL);
+  munmap(pcm.map, pcm.length);
+  pcm.map = NULL;
 }
 
+/*
+ * libsndfile 1.1 and later read MPEG audio too.  That is left to libmad,
+ * which drops skimmed frames without decoding them.  SF_FORMAT_MPEG is an
+ * enumerator, not a macro, so it can not be tested for with #ifdef.
+ */
+#define SNDFILE_FORMAT_MPEG 0x230000
+
 static int
 play_sndfile (int fd, char const *begin, char const *end)
 {
   sf_count_t maxFrames = 0;
   memset (&sfinfo, 0, sizeof (sfinfo));
-  if ((sndfile = sf_open_fd (dup(fd), SFM_READ, &sfinfo, 1))) {
+  if ((sndfile = sf_open_virtual (&virtualInput, SFM_READ, &sfinfo, NULL))) {
+    if ((sfinfo.format & SF_FORMAT_TYPEMASK) == SNDFILE_FORMAT_MPEG) {
+      sf_close(sndfile);
+      input_seek(0, SEEK_SET);
+      return 0;
+    }
     if (begin) {
       double time;
       if (parse_double_time(&time, begin) == -1) {
 	fprintf(stderr, "Unable to parse time spec: %s\n", begin);
 	goto close;
       }
-      sf_seek(sndfile, (sf_count_t)(time * sfinfo.samplerate), SEEK_SET);
+      if ((sndfilePos = sf_seek(sndfile, (sf_count_t)(time * sfinfo.samplerate), SEEK_SET)) == -1)
+	sndfilePos = 0;
     }
     if (end) {
       double time;
@@ -882,46 +3384,67 @@ play_sndfile (int fd, char const *begin, char const *end)
     }
     audio_format.bits = 16;
     audio_format.channels = sfinfo.channels;
-    audio_format.rate = sfinfo.samplerate;
+    audio_format.rate = device_rate(sfinfo.samplerate);
     audio_format.byte_format = AO_FMT_LITTLE;
     if (audio_device) {
       fprintf(stderr, "Audio device already open.\n");
       goto close;
       return 1;
     }
-    audio_device = ao_open_live(audio_driver, &audio_format, NULL);
+    audio_device = open_device();
     if (!audio_device) {
       fprintf(stderr, "Error opening audio device: %d.\n", errno);
       goto close;
       return 1;
     }
-    st->setSampleRate(sfinfo.samplerate);
-    st->setChannels(sfinfo.channels);
+    if (map_pcm(fd)) {
+      /* The mapping already holds everything, no history needed */
+      source_setup(sfinfo.samplerate, sfinfo.channels, 0);
+      play_pcm(maxFrames);
+      goto close;
+    }
+    source_setup(sfinfo.samplerate, sfinfo.channels, 1);
+    backendSeek = seek_sndfile;
     {
       float buf[512 * sfinfo.channels];
       sf_count_t nFrames;
       sf_count_t readFrames = 0;
-      while ((nFrames = sf_readf_float(sndfile, buf, 512)) > 0 && readFrames < maxFrames) {
-	if (readFrames + nFrames > maxFrames) nFrames = maxFrames - readFrames;
+      for (;;) {
+	sf_count_t gap = skim_gap();
+	if (gap) {
+	  /* Skimming, seek over the dropped part instead of decoding it */
+	  if (sf_seek(sndfile, gap, SEEK_CUR) == -1) break;
+	  skim_block(gap);
+	  readFrames += gap;
+	  sndfilePos += gap;
+	}
+	if (maxFrames && readFrames >= maxFrames) break;
+	if ((nFrames = sf_readf_float(sndfile, buf, 512)) <= 0) break;
+	if (maxFrames && readFrames + nFrames > maxFrames)
+	  nFrames = maxFrames - readFrames;
+	skim_block(nFrames);
 	SAMPLETYPE samples[nFrames * sfinfo.channels];
 	int i;
 	for (i=0; i<nFrames*sfinfo.channels; i++) {
 	  samples[i] = buf[i]*32700.0;
 	}
-	st->putSamples(samples, nFrames);
+	count_copy(STAGE_DECODE, nFrames * sfinfo.channels *
+				 (sizeof(float) + sizeof(SAMPLETYPE)));
         readFrames += nFrames;
-	play_ao(sfinfo.channels, nFrames);
-	pollKeyboard(seek_sndfile);
+	sndfilePos += nFrames;
+	feed(sndfilePos - nFrames, samples, nFrames);
+	pollKeyboard(seek_stream);
 	if (quit) goto close;
       }
     }
   close:
+    stretch_flush();
     sf_close(sndfile);
     return 1;
   } else {
     fprintf(stderr, "libsndfile: %s\n", sf_strerror(NULL));
   }
-  lseek(fd,0,SEEK_SET);
+  input_seek(0, SEEK_SET);
   return 0;
 }
 